@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "cbuff.h"
+#include "framing.h"
+
+// ns/byte for the paths every byte takes through a cbuff: finding
+// record ends, copying in and out, and reading and writing fds
+
+#define RING     4096
+#define RECORD   256
+#define BYTES    (64 * 1024 * 1024)
+
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report (const char *what, double ns, long bytes)
+{
+  printf ("%-24s %8.3f ns/byte\n", what, ns / bytes);
+}
+
+// records of RECORD bytes ending in '\n', found with the delimiter
+// framer as they would be after each read
+static void bench_find (void)
+{
+  struct framing fr = { FRAME_DELIM, '\n' };
+  struct framer f;
+  struct cbuff cb;
+  char rec[RECORD];
+  long bytes = 0;
+
+  memset (rec, 'x', RECORD - 1);
+  rec[RECORD - 1] = '\n';
+  new_cbuff (&cb, RING);
+  framer_init (&f, &fr);
+  double t = now_ns ();
+  while (bytes < BYTES) {
+    buf2cbuf (&cb, rec, RECORD);
+    int n = framer_next (&f, &cb);
+    cbuf_discard (&cb, n);
+    framer_consume (&f, n);
+    bytes += RECORD;
+  }
+  t = now_ns () - t;
+  report ("find (delim framer)", t, bytes);
+  free_cbuff (&cb);
+}
+
+static void bench_copy (void)
+{
+  struct cbuff cb;
+  char in[RECORD * 3], out[RECORD * 3];
+  long bytes = 0;
+
+  memset (in, 'x', sizeof(in));
+  new_cbuff (&cb, RING);
+  // an odd size so copies keep crossing the end of the ring
+  double t = now_ns ();
+  while (bytes < BYTES) {
+    buf2cbuf (&cb, in, sizeof(in) - 1);
+    struct iovec iov[2];
+    int iovcnt = cbuf_iov (&cb, sizeof(out) - 1, iov);
+    memcpy (out, iov[0].iov_base, iov[0].iov_len);
+    if (iovcnt > 1)
+      memcpy (out + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    cbuf_discard (&cb, sizeof(out) - 1);
+    bytes += sizeof(in) - 1;
+  }
+  t = now_ns () - t;
+  report ("copy in and out", t, bytes);
+  free_cbuff (&cb);
+}
+
+static void bench_io (void)
+{
+  struct cbuff cb;
+  char buf[RING];
+  int p[2], q[2];
+  long rbytes = 0, wbytes = 0;
+  double rt = 0, wt = 0;
+
+  if (pipe2 (p, O_NONBLOCK) < 0 || pipe2 (q, O_NONBLOCK) < 0) {
+    perror ("pipe");
+    return;
+  }
+  memset (buf, 'x', sizeof(buf));
+  new_cbuff (&cb, RING);
+  while (rbytes < BYTES / 4) {
+    if (write (p[1], buf, RECORD * 3) != RECORD * 3)
+      break;
+    double t = now_ns ();
+    int n = 0, r;
+    while (n < RECORD * 3 && (r = read2cbuf (&cb, p[0])) > 0)
+      n += r;
+    rt += now_ns () - t;
+    rbytes += n;
+
+    t = now_ns ();
+    int w = cbuf2write (&cb, q[1], n);
+    wt += now_ns () - t;
+    wbytes += w;
+    while (read (q[0], buf, sizeof(buf)) > 0)
+      ;
+  }
+  report ("read2cbuf from pipe", rt, rbytes);
+  report ("cbuf2write to pipe", wt, wbytes);
+  free_cbuff (&cb);
+  close (p[0]);
+  close (p[1]);
+  close (q[0]);
+  close (q[1]);
+}
+
+int main (int argc, char **argv)
+{
+  setlogmask (LOG_UPTO (LOG_CRIT));
+  bench_find ();
+  bench_copy ();
+  bench_io ();
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "cbuff.h"
+#include "framing.h"
+
+// ns/byte for each framer, with records arriving in reads that don't
+// line up with them, as they would from a socket
+
+#define RING     16384
+#define CHUNK    1448           // one TCP segment
+#define STREAM   (1024 * 1024)
+#define PASSES   256
+
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// append n bytes to the ring as a read would
+static void put (struct cbuff *cb, const unsigned char *p, int n)
+{
+  int first = cb->len - cb->end;
+  if (first > n)
+    first = n;
+  memcpy (cb->buff + cb->end, p, first);
+  memcpy (cb->buff, p + first, n - first);
+  cb->end = (cb->end + n) % cb->len;
+  cb->left -= n;
+}
+
+// a stream of records of 16 to 1039 payload bytes in the given framing
+static int build (const struct framing *fr, unsigned char *s)
+{
+  int n = 0;
+  srandom (1);
+  while (1) {
+    int len = 16 + random () % 1024;
+    if (n + len + 8 > STREAM)
+      return n;
+    if (fr->kind == FRAME_LENGTH) {
+      s[n++] = len >> 8;
+      s[n++] = len;
+    }
+    memset (s + n, 'x', len);
+    n += len;
+    if (fr->kind != FRAME_LENGTH)
+      s[n++] = fr->flag;
+  }
+}
+
+static void bench (const char *spec)
+{
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+  unsigned char *s = malloc (STREAM);
+  long bytes = 0, records = 0;
+  double t = 0;
+
+  if (parse_framing (&fr, spec) < 0) {
+    fprintf (stderr, "bad framing %s\n", spec);
+    exit (1);
+  }
+  int len = build (&fr, s);
+  new_cbuff (&cb, RING);
+  framer_init (&f, &fr);
+  for (int pass = 0 ; pass < PASSES ; pass++) {
+    for (int off = 0 ; off < len ; off += CHUNK) {
+      int n = (len - off < CHUNK) ? len - off : CHUNK;
+      put (&cb, s + off, n);
+      double t0 = now_ns ();
+      int r;
+      while ((r = framer_next (&f, &cb)) > 0) {
+	cbuf_discard (&cb, r);
+	framer_consume (&f, r);
+	records++;
+      }
+      t += now_ns () - t0;
+      if (r < 0) {
+	fprintf (stderr, "%s: framing error\n", spec);
+	exit (1);
+      }
+    }
+    bytes += len;
+  }
+  printf ("%-12s %8.3f ns/byte %8.1f ns/record\n", spec, t / bytes, t / records);
+  free_cbuff (&cb);
+  free (s);
+}
+
+int main (int argc, char **argv)
+{
+  setlogmask (LOG_UPTO (LOG_CRIT));
+  if (argc > 1) {
+    for (int i = 1 ; i < argc ; i++)
+      bench (argv[i]);
+    return 0;
+  }
+  bench ("raw");
+  bench ("delim");
+  bench ("length:2");
+  bench ("slip");
+  bench ("cobs");
+  bench ("hdlc");
+  return 0;
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// latency of records from a connection to the tty, to p999, with
+// mux2tty on its own, with every cpu kept busy by other processes, and
+// with those hogs while mux2tty runs --realtime.  runs mux2tty on a pty:
+//   bench-rt [path to mux2tty] [port]
+// real-time mode needs root or CAP_SYS_NICE and CAP_IPC_LOCK.
+
+#define SAMPLES   5000
+#define MAXHOGS   64
+
+static double now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connect_to (int port)
+{
+  struct sockaddr_in sa;
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int bench (const char *what, const char *exe, int port, int hogs, int rt)
+{
+  static double lat[SAMPLES];
+  pid_t hog[MAXHOGS];
+  char name[64], portstr[16], rec[64], buf[256];
+  int m, s;
+
+  if (openpty (&m, &s, name, NULL, NULL) < 0) {
+    perror ("openpty");
+    return -1;
+  }
+  struct termios raw;
+  tcgetattr (m, &raw);
+  cfmakeraw (&raw);
+  tcsetattr (m, TCSANOW, &raw);
+
+  snprintf (portstr, sizeof(portstr), "%d", port);
+  pid_t d = fork ();
+  if (d == 0) {
+    int null = open ("/dev/null", O_WRONLY);
+    dup2 (null, 2);
+    if (rt)
+      execl (exe, exe, "-n", "--realtime=0", "--max-sessions=16", "--session-buffer=64:64:4096",
+	     name, "57600", portstr, (char *) NULL);
+    else
+      execl (exe, exe, "-n", name, "57600", portstr, (char *) NULL);
+    perror (exe);
+    _exit (1);
+  }
+  usleep (300000);
+
+  int c = connect_to (port);
+  if (c < 0) {
+    fprintf (stderr, "%s: can't connect to %s on port %d\n", what, exe, port);
+    kill (d, SIGTERM);
+    waitpid (d, NULL, 0);
+    return -1;
+  }
+
+  for (int i=0 ; i<hogs ; i++)
+    if ((hog[i] = fork ()) == 0)
+      while (1)
+	;
+
+  int ret = 0;
+  for (int i=0 ; i<SAMPLES && !ret ; i++) {
+    int n = snprintf (rec, sizeof(rec), "sample %d\n", i);
+    double t = now_us ();
+    if (write (c, rec, n) != n)
+      ret = -1;
+    int got = 0;
+    while (!ret && got < n) {
+      struct pollfd p = { m, POLLIN, 0 };
+      int r;
+      if (poll (&p, 1, 2000) <= 0 || (r = read (m, buf, sizeof(buf))) <= 0) {
+	fprintf (stderr, "%s: record %d didn't arrive\n", what, i);
+	ret = -1;
+      } else {
+	got += r;
+      }
+    }
+    lat[i] = now_us () - t;
+  }
+  if (!ret) {
+    qsort (lat, SAMPLES, sizeof(double), cmp);
+    printf ("%-20s p50 %8.1f  p99 %8.1f  p999 %8.1f  max %8.1f us\n", what,
+	    lat[SAMPLES / 2], lat[SAMPLES * 99 / 100], lat[SAMPLES * 999 / 1000],
+	    lat[SAMPLES - 1]);
+  }
+
+  for (int i=0 ; i<hogs ; i++) {
+    kill (hog[i], SIGKILL);
+    waitpid (hog[i], NULL, 0);
+  }
+  close (c);
+  kill (d, SIGTERM);
+  waitpid (d, NULL, 0);
+  close (m);
+  close (s);
+  return ret;
+}
+
+int main (int argc, char **argv)
+{
+  const char *exe = argc > 1 ? argv[1] : "./mux2tty";
+  int port = argc > 2 ? atoi (argv[2]) : 40000 + getpid () % 10000;
+  int hogs = sysconf (_SC_NPROCESSORS_ONLN);
+  int ret = 0;
+
+  if (hogs > MAXHOGS)
+    hogs = MAXHOGS;
+  ret |= bench ("idle", exe, port, 0, 0) < 0;
+  ret |= bench ("cpu hogs", exe, port + 1, hogs, 0) < 0;
+  ret |= bench ("cpu hogs, realtime", exe, port + 2, hogs, 1) < 0;
+  return ret;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// latency of records from one steady connection to the tty, first on
+// their own and then while other clients connect and disconnect as
+// fast as they can.  runs mux2tty on a pty:
+//   bench-storm [path to mux2tty] [port]
+
+#define SAMPLES   2000
+#define STORM     32            // connections opened and closed per round
+
+static double now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connect_to (int port)
+{
+  struct sockaddr_in sa;
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+// clients that connect, send half a record and go away
+static void storm (int port)
+{
+  int fds[STORM];
+  struct linger l = { 1, 0 };
+
+  while (1) {
+    for (int i=0 ; i<STORM ; i++) {
+      fds[i] = connect_to (port);
+      if (fds[i] >= 0 && (i & 1))
+	(void) !write (fds[i], "half a rec", 10);
+    }
+    for (int i=0 ; i<STORM ; i++) {
+      if (fds[i] < 0)
+	continue;
+      // every other one resets instead of closing
+      if (i & 2)
+	setsockopt (fds[i], SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+      close (fds[i]);
+    }
+  }
+}
+
+static int cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// send a record and time it to the tty, SAMPLES times
+static int measure (const char *what, int c, int m)
+{
+  static double lat[SAMPLES];
+  char rec[64], buf[256];
+
+  for (int i=0 ; i<SAMPLES ; i++) {
+    int n = snprintf (rec, sizeof(rec), "sample %d\n", i);
+    double t = now_us ();
+    if (write (c, rec, n) != n)
+      return -1;
+    int got = 0;
+    while (got < n) {
+      struct pollfd p = { m, POLLIN, 0 };
+      if (poll (&p, 1, 2000) <= 0) {
+	fprintf (stderr, "%s: record %d didn't arrive\n", what, i);
+	return -1;
+      }
+      int r = read (m, buf, sizeof(buf));
+      if (r <= 0)
+	return -1;
+      got += r;
+    }
+    lat[i] = now_us () - t;
+  }
+  qsort (lat, SAMPLES, sizeof(double), cmp);
+  printf ("%-16s p50 %8.1f  p99 %8.1f  p999 %8.1f  max %8.1f us\n", what,
+	  lat[SAMPLES / 2], lat[SAMPLES * 99 / 100], lat[SAMPLES * 999 / 1000],
+	  lat[SAMPLES - 1]);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char *exe = argc > 1 ? argv[1] : "./mux2tty";
+  int port = argc > 2 ? atoi (argv[2]) : 40000 + getpid () % 10000;
+  char name[64], portstr[16];
+  int m, s;
+
+  if (openpty (&m, &s, name, NULL, NULL) < 0) {
+    perror ("openpty");
+    return 1;
+  }
+  struct termios raw;
+  tcgetattr (m, &raw);
+  cfmakeraw (&raw);
+  tcsetattr (m, TCSANOW, &raw);
+
+  snprintf (portstr, sizeof(portstr), "%d", port);
+  pid_t d = fork ();
+  if (d == 0) {
+    int null = open ("/dev/null", O_WRONLY);
+    dup2 (null, 2);
+    execl (exe, exe, "-n", name, "57600", portstr, (char *) NULL);
+    perror (exe);
+    _exit (1);
+  }
+  usleep (300000);
+
+  int c = connect_to (port);
+  if (c < 0) {
+    fprintf (stderr, "can't connect to %s on port %d\n", exe, port);
+    kill (d, SIGTERM);
+    return 1;
+  }
+  int ret = measure ("quiet", c, m) < 0;
+
+  pid_t st = fork ();
+  if (st == 0) {
+    storm (port);
+    _exit (0);
+  }
+  usleep (100000);
+  ret |= measure ("reconnect storm", c, m) < 0;
+
+  kill (st, SIGKILL);
+  waitpid (st, NULL, 0);
+  kill (d, SIGTERM);
+  waitpid (d, NULL, 0);
+  return ret;
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+
+// what each --tty-profile costs and what it gets: how often mux2tty's
+// select returns while idle and per KB read from the tty, and how long
+// each byte takes from the tty to a connection, with the tty fed at
+// about 115200 baud.
+//   bench-tty [path to mux2tty] [port]
+
+#define CHUNK     12            // bytes per ms, about 115200 baud
+#define RUN_MS    2000
+#define BYTES     (CHUNK * RUN_MS)
+
+static double now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static char tracefn[64];
+
+// have mux2tty dump its trace and count the times select returned since
+// the event numbered from.  returns the number of events so far.
+static unsigned long long wakeups (pid_t pid, unsigned long long from, long *n)
+{
+  static struct trace_event ev[TRACE_EVENTS];
+  struct trace_header h;
+
+  kill (pid, SIGUSR1);
+  usleep (50000);
+  FILE *f = fopen (tracefn, "r");
+  if (!f || fread (&h, sizeof(h), 1, f) != 1 || h.events != TRACE_EVENTS ||
+      fread (ev, sizeof(ev[0]), TRACE_EVENTS, f) != TRACE_EVENTS) {
+    if (f)
+      fclose (f);
+    *n = -1;
+    return 0;
+  }
+  fclose (f);
+  if (h.head - from > TRACE_EVENTS)
+    from = h.head - TRACE_EVENTS;
+  *n = 0;
+  for (unsigned long long i=from ; i<h.head ; i++)
+    if (ev[i & (TRACE_EVENTS - 1)].type == TR_WAKE)
+      (*n)++;
+  return h.head;
+}
+
+static int connect_to (int port)
+{
+  struct sockaddr_in sa;
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    if (fd >= 0)
+      close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int bench (const char *exe, const char *profile, int port)
+{
+  static double sent[BYTES];
+  char name[64], portstr[16], opt[64], tropt[96], buf[4096];
+  int m, s;
+
+  if (openpty (&m, &s, name, NULL, NULL) < 0) {
+    perror ("openpty");
+    return -1;
+  }
+  struct termios raw;
+  tcgetattr (m, &raw);
+  cfmakeraw (&raw);
+  tcsetattr (m, TCSANOW, &raw);
+
+  snprintf (portstr, sizeof(portstr), "%d", port);
+  snprintf (opt, sizeof(opt), "--tty-profile=%s", profile);
+  snprintf (tracefn, sizeof(tracefn), "/tmp/bench-tty.%d.trace", (int) getpid ());
+  snprintf (tropt, sizeof(tropt), "--trace-file=%s", tracefn);
+  pid_t d = fork ();
+  if (d == 0) {
+    int null = open ("/dev/null", O_WRONLY);
+    dup2 (null, 2);
+    execl (exe, exe, "-n", opt, tropt, name, "115200", portstr, (char *) NULL);
+    perror (exe);
+    _exit (1);
+  }
+  usleep (300000);
+
+  int c = connect_to (port);
+  if (c < 0) {
+    fprintf (stderr, "can't connect to %s on port %d\n", exe, port);
+    kill (d, SIGTERM);
+    waitpid (d, NULL, 0);
+    return -1;
+  }
+
+  long idle, busy;
+  unsigned long long head = wakeups (d, 0, &idle);
+  usleep (1000000);
+  head = wakeups (d, head, &idle);
+
+  memset (buf, 'x', sizeof(buf));
+  double start = now_us (), lat = 0;
+  long out = 0, in = 0;
+  while (in < BYTES) {
+    double t = now_us ();
+    long due = (long) ((t - start) / 1000) * CHUNK + CHUNK;
+    if (due > BYTES)
+      due = BYTES;
+    if (out < due) {
+      int n = write (m, buf, due - out);
+      for (int i=0 ; i<n ; i++)
+	sent[out + i] = t;
+      if (n > 0)
+	out += n;
+    }
+    struct pollfd p = { c, POLLIN, 0 };
+    int ms = out < BYTES ? 1 : 2000;
+    if (poll (&p, 1, ms) < 0)
+      break;
+    if (p.revents & POLLIN) {
+      int n = read (c, buf, sizeof(buf));
+      if (n <= 0)
+	break;
+      t = now_us ();
+      for (int i=0 ; i<n ; i++)
+	lat += t - sent[in + i];
+      in += n;
+    } else if (out == BYTES) {
+      fprintf (stderr, "%s: %ld of %d bytes arrived\n", profile, in, BYTES);
+      break;
+    }
+  }
+  wakeups (d, head, &busy);
+  printf ("%-16s idle %6ld wakeups/s  %8.1f wakeups/KB  %8.1f us/byte\n",
+	  profile, idle, busy * 1024.0 / BYTES, in ? lat / in : 0);
+
+  close (c);
+  kill (d, SIGTERM);
+  waitpid (d, NULL, 0);
+  close (m);
+  close (s);
+  unlink (tracefn);
+  return in == BYTES ? 0 : -1;
+}
+
+int main (int argc, char **argv)
+{
+  const char *exe = argc > 1 ? argv[1] : "./mux2tty";
+  int port = argc > 2 ? atoi (argv[2]) : 40000 + getpid () % 10000;
+  int ret = 0;
+
+  ret |= bench (exe, "default", port) < 0;
+  ret |= bench (exe, "latency", port + 1) < 0;
+  ret |= bench (exe, "throughput", port + 2) < 0;
+  ret |= bench (exe, "throughput:255", port + 3) < 0;
+  return ret;
+}
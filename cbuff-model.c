@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "cbuff.h"
+#include "cbuff-model.h"
+
+#define FAIL(m, ...) \
+  do { fprintf (stderr, "op %d: ", (m)->ops); fprintf (stderr, __VA_ARGS__); \
+       fputc ('\n', stderr); return -1; } while (0)
+
+// copy up to n bytes out of cb and drop them from it
+int model_take (struct cbuff *cb, unsigned char *buf, int n)
+{
+  struct iovec iov[2];
+  int csize = cb->len - cb->left;
+
+  if (n > csize)
+    n = csize;
+  if (!n)
+    return 0;
+  int iovcnt = cbuf_iov (cb, n, iov);
+  memcpy (buf, iov[0].iov_base, iov[0].iov_len);
+  if (iovcnt > 1)
+    memcpy (buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+  return cbuf_discard (cb, n);
+}
+
+int model_init (struct cbuff_model *m, int size)
+{
+  memset (m, 0, sizeof(*m));
+  if (new_cbuff (&m->cb, size) < 0)
+    return -1;
+  if (pipe2 (m->in, O_NONBLOCK) < 0 || pipe2 (m->out, O_NONBLOCK) < 0)
+    return -1;
+  return 0;
+}
+
+void model_free (struct cbuff_model *m)
+{
+  free_cbuff (&m->cb);
+  close (m->in[0]);
+  close (m->in[1]);
+  close (m->out[0]);
+  close (m->out[1]);
+}
+
+static void fill (struct cbuff_model *m, unsigned char *p, int n)
+{
+  for (int i=0 ; i<n ; i++)
+    p[i] = m->seq++;
+}
+
+static void pop (struct cbuff_model *m, int n)
+{
+  memmove (m->q, m->q + n, m->qlen - n);
+  m->qlen -= n;
+}
+
+// the ring's bookkeeping and content against the model
+static int check (struct cbuff_model *m)
+{
+  struct cbuff *cb = &m->cb;
+  int csize = cb->len - cb->left;
+
+  if (cb->left < 0 || cb->left > cb->len)
+    FAIL (m, "left %d outside 0..%d", cb->left, cb->len);
+  if (cb->start < 0 || cb->start >= cb->len || cb->end < 0 || cb->end >= cb->len)
+    FAIL (m, "start %d or end %d outside ring of %d", cb->start, cb->end, cb->len);
+  if ((cb->start + csize) % cb->len != cb->end)
+    FAIL (m, "start %d + %d bytes != end %d in ring of %d", cb->start, csize, cb->end, cb->len);
+  if (csize != m->qlen)
+    FAIL (m, "ring holds %d bytes, model %d", csize, m->qlen);
+  for (int i=0 ; i<csize ; i++)
+    if ((unsigned char) cb->buff[(cb->start + i) % cb->len] != m->q[i])
+      FAIL (m, "byte %d differs", i);
+  return 0;
+}
+
+int model_step (struct cbuff_model *m, int op, int arg)
+{
+  struct cbuff *cb = &m->cb;
+  int csize = cb->len - cb->left;
+  unsigned char buf[MODEL_MAXLEN];
+  int n, want, got;
+
+  m->ops++;
+  switch (op) {
+  case 0:
+    // buf2cbuf, sometimes more than fits
+    n = arg % (cb->len + 8);
+    if (n > MODEL_MAXLEN)
+      n = MODEL_MAXLEN;
+    fill (m, buf, n);
+    want = n < cb->left ? n : cb->left;
+    got = buf2cbuf (cb, (char *) buf, n);
+    if (got != want)
+      FAIL (m, "buf2cbuf %d returned %d, expected %d", n, got, want);
+    memcpy (m->q + m->qlen, buf, want);
+    m->qlen += want;
+    break;
+
+  case 1:
+    // copy out through cbuf_iov and cbuf_discard, as a caller that
+    // needs the bytes contiguous would, sometimes asking for more than
+    // there is
+    n = arg % (cb->len + 8);
+    want = n < csize ? n : csize;
+    got = model_take (cb, buf, n);
+    if (got != want)
+      FAIL (m, "copy out %d returned %d, expected %d", n, got, want);
+    if (memcmp (buf, m->q, want))
+      FAIL (m, "copy out %d copied the wrong bytes", n);
+    pop (m, want);
+    break;
+
+  case 2:
+    // read2cbuf from a pipe holding arg bytes more, or nothing
+    n = arg % 64;
+    if (m->npending + n > MODEL_MAXLEN)
+      n = MODEL_MAXLEN - m->npending;
+    fill (m, m->pending + m->npending, n);
+    if (n && write (m->in[1], m->pending + m->npending, n) != n)
+      FAIL (m, "pipe write failed");
+    m->npending += n;
+    if (!cb->left || !m->npending) {
+      want = -1;
+    } else {
+      // one read, up to the end of the ring
+      want = cb->len - cb->end;
+      if (cb->left < want)
+	want = cb->left;
+      if (m->npending < want)
+	want = m->npending;
+    }
+    got = read2cbuf (cb, m->in[0]);
+    if (got != want)
+      FAIL (m, "read2cbuf returned %d, expected %d (left %d, end %d, %d queued)",
+	    got, want, cb->left, cb->end, m->npending);
+    if (got > 0) {
+      memcpy (m->q + m->qlen, m->pending, got);
+      m->qlen += got;
+      memmove (m->pending, m->pending + got, m->npending - got);
+      m->npending -= got;
+    }
+    break;
+
+  case 3:
+    // cbuf2write to a pipe, then what came out must match
+    n = arg % (cb->len + 8);
+    want = csize ? (n < csize ? n : csize) : -1;
+    got = cbuf2write (cb, m->out[1], n);
+    if (got != want)
+      FAIL (m, "cbuf2write %d returned %d, expected %d", n, got, want);
+    if (got > 0) {
+      if (read (m->out[0], buf, got) != got)
+	FAIL (m, "cbuf2write %d wrote short", n);
+      if (memcmp (buf, m->q, got))
+	FAIL (m, "cbuf2write %d wrote the wrong bytes", n);
+      pop (m, got);
+    }
+    break;
+
+  case 4:
+    // resize_cbuff, refused when the content wouldn't fit
+    if (arg & 1 && csize > 1) {
+      n = csize - 1 - (arg >> 1) % csize;
+      if (n < 1)
+	n = 1;
+      int len = cb->len;
+      if (resize_cbuff (cb, n) != -1 || cb->len != len)
+	FAIL (m, "resize_cbuff to %d under %d bytes of content succeeded", n, csize);
+    } else {
+      n = csize + (arg >> 1) % 64;
+      if (n < 1)
+	n = 1;
+      if (n > MODEL_MAXLEN)
+	n = MODEL_MAXLEN;
+      if (resize_cbuff (cb, n) < 0 || cb->len != n)
+	FAIL (m, "resize_cbuff to %d failed", n);
+    }
+    break;
+
+  case 5: {
+    // cbuf_iov maps the content in place, cbuf_discard drops it
+    struct iovec iov[2];
+    n = csize ? arg % (csize + 1) : 0;
+    int iovcnt = cbuf_iov (cb, n, iov);
+    int off = 0;
+    for (int i=0 ; i<iovcnt ; i++) {
+      if (memcmp (iov[i].iov_base, m->q + off, iov[i].iov_len))
+	FAIL (m, "cbuf_iov %d segment %d maps the wrong bytes", n, i);
+      off += iov[i].iov_len;
+    }
+    if (off != n)
+      FAIL (m, "cbuf_iov %d mapped %d bytes", n, off);
+    if (cbuf_discard (cb, n) != n)
+      FAIL (m, "cbuf_discard %d", n);
+    pop (m, n);
+    break;
+  }
+
+  case 6:
+    // fill the ring exactly, the case where start == end is ambiguous
+    n = cb->left;
+    fill (m, buf, n);
+    if (buf2cbuf (cb, (char *) buf, n) != n)
+      FAIL (m, "filling %d bytes failed", n);
+    memcpy (m->q + m->qlen, buf, n);
+    m->qlen += n;
+    if (cb->left || cb->start != cb->end)
+      FAIL (m, "full ring has left %d, start %d, end %d", cb->left, cb->start, cb->end);
+    break;
+  }
+  return check (m);
+}
+
+// first byte picks the ring size, then pairs of bytes are op and arg
+int model_run (const unsigned char *data, int len)
+{
+  struct cbuff_model *m = malloc (sizeof(*m));
+  int r = 0;
+
+  if (!m || len < 1 || model_init (m, 1 + data[0] % 128) < 0) {
+    free (m);
+    return 0;
+  }
+  for (int i=1 ; i+1<len && !r ; i+=2)
+    r = model_step (m, data[i] % MODEL_OPS, data[i+1] * 7);
+  model_free (m);
+  free (m);
+  return r;
+}
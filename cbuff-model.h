@@ -0,0 +1,24 @@
+// drives a cbuff and a plain byte queue through the same operations
+// and checks they agree.  shared by test-cbuff and fuzz-cbuff.
+
+#define MODEL_MAXLEN  8192
+
+struct cbuff_model {
+  struct cbuff cb;
+  unsigned char q[MODEL_MAXLEN];   // what the ring should hold, oldest first
+  int qlen;
+  int in[2];                       // pipe read2cbuf reads from
+  unsigned char pending[MODEL_MAXLEN];   // written to in, not yet read
+  int npending;
+  int out[2];                      // pipe cbuf2write writes to
+  unsigned char seq;               // next byte of generated data
+  int ops;
+};
+
+#define MODEL_OPS  7
+
+int model_init (struct cbuff_model *m, int size);
+void model_free (struct cbuff_model *m);
+int model_step (struct cbuff_model *m, int op, int arg);
+int model_run (const unsigned char *data, int len);
+int model_take (struct cbuff *cb, unsigned char *buf, int n);
@@ -4,18 +4,85 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include "cbuff.h"
 
+// buffers set aside by cbuf_reserve, a pool for each size reserved.
+// requests are served from the smallest pool they fit at its full size,
+// and buffers of a pool's size go back to it when freed, so sessions
+// stop touching the heap.
+#define CBUFF_POOLS 4
+
+static struct {
+  char **buff;
+  int pooled;
+  int count;
+  int size;
+} pools[CBUFF_POOLS];
+static int npools = 0;
+
+int cbuf_reserve (int count, int size)
+{
+  if (npools == CBUFF_POOLS)
+    return -1;
+  char **pool = (char **) calloc (count, sizeof(char *));
+  if (!pool)
+    return -1;
+  for (int i=0 ; i<count ; i++) {
+    pool[i] = (char *) malloc (size);
+    if (!pool[i])
+      return -1;
+    // fault every page in now rather than on first use
+    memset (pool[i], 0, size);
+  }
+  pools[npools].buff = pool;
+  pools[npools].pooled = count;
+  pools[npools].count = count;
+  pools[npools].size = size;
+  npools++;
+  syslog (LOG_DEBUG, "cbuf_reserve: %d buffers of %d bytes", count, size);
+  return 0;
+}
+
+static void release_buff (char *buff, int n)
+{
+  for (int i=0 ; i<npools ; i++)
+    if (n == pools[i].size && pools[i].pooled < pools[i].count) {
+      pools[i].buff[pools[i].pooled++] = buff;
+      return;
+    }
+  free (buff);
+}
+
+// the smallest pool with a buffer of at least n bytes, or -1
+static int find_pool (int n)
+{
+  int best = -1;
+  for (int i=0 ; i<npools ; i++)
+    if (n <= pools[i].size && pools[i].pooled &&
+	(best < 0 || pools[i].size < pools[best].size))
+      best = i;
+  return best;
+}
+
 int new_cbuff (struct cbuff *cb, int n) 
 {
   syslog (LOG_DEBUG, "new_cbuff: allocating new cbuff of size %d",n);
-  cb->buff = (char *) malloc (n);
+  if (n <= 0)
+    return -1;
+  int i = find_pool (n);
+  if (i >= 0) {
+    cb->buff = pools[i].buff[--pools[i].pooled];
+    n = pools[i].size;
+  } else {
+    // nothing is read from the buffer before it has been written, so
+    // it isn't cleared
+    cb->buff = (char *) malloc (n);
+  }
   if (!cb->buff)
     return -1;
 
-  memset (cb->buff, 0, n);
-
   cb->start = 0;
   cb->end = 0;
   cb->len = n;
@@ -26,7 +93,7 @@ int new_cbuff (struct cbuff *cb, int n)
 int free_cbuff (struct cbuff *cb) {
   syslog (LOG_DEBUG, "free_cbuff: freeing cbuff of size %d with %d remaining unused",cb->len,cb->left);
   if (cb->buff)
-    free(cb->buff);
+    release_buff(cb->buff,cb->len);
   cb->buff = NULL;
   cb->start = 0;
   cb->end = 0;
@@ -39,7 +106,7 @@ int resize_cbuff (struct cbuff *cb, int n) {
   syslog (LOG_DEBUG, "resize_cbuff: resizing cbuff from size %d to %d",cb->len,n);
 
   int csize = cb->len - cb->left;
-  if (csize > n) {
+  if (n <= 0 || csize > n) {
     syslog (LOG_DEBUG, "cannot shrink buffer with %d bytes to %d",csize,n);
     return -1;
   }
@@ -54,30 +121,32 @@ int resize_cbuff (struct cbuff *cb, int n) {
   for (int i=0 ; i<csize ; i++) {
     new_buff[i] = cb->buff[(cb->start + i) % cb->len];
   }
+  syslog (LOG_DEBUG, "freeing old buffer");
+  release_buff(cb->buff,cb->len);
   cb->start = 0;
-  cb->end = csize;
+  cb->end = csize % n;     // a ring resized to its content is full
   cb->len = n;
   cb->left = n - csize;
-  syslog (LOG_DEBUG, "freeing old buffer");
-  free(cb->buff);
   cb->buff = new_buff;
   return 0;
 }
 
 int dump_cbuf(struct cbuff *cb) 
 {
+  int csize = cb->len - cb->left;
   fprintf(stderr, "[");
-  for (int i = 0 ; i < cb->len - cb->left ; i++)
-    fprintf(stderr, " %02x", cb->buff[(cb->start + i) % cb->len]);
+  for (int i = 0 ; i < csize ; i++)
+    fprintf(stderr, " %02x", (unsigned char) cb->buff[(cb->start + i) % cb->len]);
   fprintf(stderr,"]\n[");
-  for (int i = 0 ; i < cb->len - cb->left ; i++) {
-    char c = cb->buff[(cb->start + i) % cb->len];
+  for (int i = 0 ; i < csize ; i++) {
+    unsigned char c = cb->buff[(cb->start + i) % cb->len];
     if (isprint(c)) 
       fprintf(stderr, "  %c",c);
     else
       fprintf(stderr, "   ");
   }
   fprintf(stderr, "]\n");
+  return csize;
 }
 
 int read2cbuf (struct cbuff *cb, int fd) 
@@ -86,47 +155,46 @@ int read2cbuf (struct cbuff *cb, int fd)
   // end and then returns, leaving to the next read filling any unused portion of
   // the buffer at the beginning.  Since the input will be ready for reading, the
   // select call will trigger without too much delay.
-  syslog (LOG_DEBUG, "read2cbuf: reading from fd %d into buffer", fd);
   if (!cb->left) {
     syslog (LOG_ERR, "no space in buffer");
     return -1;
   }
 
-  syslog (LOG_DEBUG, "before read, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
-  int count = read (fd, cb->buff + cb->end, 
-		    ((cb->end < cb->start) ? cb->start : cb->len) - cb->end);
+  // start == end both when empty and when full, so size the free
+  // segment from left rather than from the indices
+  int o = cb->len - cb->end;
+  int count = read (fd, cb->buff + cb->end, (cb->left < o) ? cb->left : o);
   if (count > 0) {
     cb->left -= count;
     cb->end += count;
     if (cb->end == cb->len)
       cb->end = 0;
   }
-  syslog (LOG_DEBUG, "after read, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
-  syslog (LOG_DEBUG, "%d bytes read", count);
   return count;
 }
 
 int cbuf2write (struct cbuff *cb, int fd, int n)
 {
-  syslog (LOG_DEBUG, "cbuf2write: writing %d bytes to fd %d from buffer", n, fd);
-
   // if cbuff is empty, should never happen
   if (cb->left == cb->len) {
     syslog (LOG_ERR, "buffer of %d bytes is empty", cb->len);
     return -1;
   }
 
+  if (n > cb->len - cb->left)
+    n = cb->len - cb->left;
+
   int m = n;
   // keep writing until writes don't write, then return bytes written
   // caller must deal with partial write.
   while (m) {
-    int o = (cb->end <= cb->start) ? 
-      cb->len - cb->start :
-      cb->end - cb->start;
-    syslog (LOG_DEBUG, "before write, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-    dump_cbuf(cb);
+    // the used segment starting at start runs to the end of the
+    // buffer or to the end of the content, whichever is first.  the
+    // indices alone can't tell a full ring from an empty one.
+    int used = cb->len - cb->left;
+    int o = cb->len - cb->start;
+    if (used < o)
+      o = used;
     int count = write (fd, cb->buff + cb->start, (m < o) ? m : o);
     if (count > 0) {
       m -= count;
@@ -134,73 +202,121 @@ int cbuf2write (struct cbuff *cb, int fd, int n)
       cb->left += count;
       if (cb->start == cb->len)
 	cb->start = 0;
-      syslog (LOG_DEBUG, "after write, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-      dump_cbuf(cb);
     } else {
-      syslog (LOG_DEBUG, "write returned 0 bytes, returning %d total bytes written", n-m);
       return n - m;
     }
   }
-  syslog (LOG_DEBUG, "wrote %d bytes", n);
-  return n;
-}
-
-int cbuf2buf (struct cbuff *cb, char *dest, int n)
-{
-  syslog (LOG_DEBUG, "cbuf2buf: reading %d bytes from buffer into a scratch buffer", n);
-  syslog (LOG_DEBUG, "before copy, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
-  for (int i=0 ; i<n ; i++) {
-    dest[i] = cb->buff[(cb->start + i) % cb->len];
-  }
-  cb->start = (cb->start + n) % cb->len;
-  cb->left += n;
-  syslog (LOG_DEBUG, "after copy, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
   return n;
 }
 
 int buf2cbuf (struct cbuff *cb, char *src, int n)
 {
-  syslog (LOG_DEBUG, "buf2cbuf: reading %d bytes from scratch buffer into buffer", n);
-  syslog (LOG_DEBUG, "before copy, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
   if (cb->left < n)
     n = cb->left;
-  for (int i=0 ; i<n ; i++) {
-    cb->buff[(cb->end + i) % cb->len] = src[i];
-  }
+  if (!n)
+    return 0;
+  // the free space runs to the end of the ring and then from its start
+  int first = cb->len - cb->end;
+  if (first > n)
+    first = n;
+  memcpy (cb->buff + cb->end, src, first);
+  memcpy (cb->buff, src + first, n - first);
   cb->end = (cb->end + n) % cb->len;
   cb->left -= n;
-  syslog (LOG_DEBUG, "after copy, start = %d ; end = %d ; len = %d ; left = %d", cb->start, cb->end, cb->len, cb->left);
-  dump_cbuf(cb);
   return n;
 }
 	
-int cbuf_find (struct cbuff *cb, char c) 
+int cbuf_iov (struct cbuff *cb, int n, struct iovec *iov)
 {
-  if (isprint (c))
-    syslog (LOG_DEBUG, "cbuf_find: looking in buffer for \'%c\' 0x%x", c,c);
-  else
-    syslog (LOG_DEBUG, "cbuf_find: looking in buffer for 0x%x", c);
-  int csize = cb->len - cb->left;
-  for (int i=0 ; i<csize ; i++)
-    if (cb->buff[(cb->start + i) % cb->len] == c) {
-      syslog (LOG_DEBUG, "found delimiter %d bytes from start index", i+1);
-      return i+1;
+  // describe the first n bytes of the buffer in place, in at most two
+  // segments, so they can be written without copying
+  int o = cb->len - cb->start;
+  iov[0].iov_base = cb->buff + cb->start;
+  if (n <= o) {
+    iov[0].iov_len = n;
+    return 1;
+  }
+  iov[0].iov_len = o;
+  iov[1].iov_base = cb->buff;
+  iov[1].iov_len = n - o;
+  return 2;
+}
+
+int cbuf_discard (struct cbuff *cb, int n)
+{
+  if (n > cb->len - cb->left)
+    n = cb->len - cb->left;
+  if (cb->len)
+    cb->start = (cb->start + n) % cb->len;
+  cb->left += n;
+  return n;
+}
+
+#define SIZING_LIMIT     1024
+
+// smallest power of two holding n bytes
+static int pow2_bucket (int n)
+{
+  return n <= 1 ? 0 : 32 - __builtin_clz (n - 1);
+}
+
+void cbuf_note_record (struct cbuff_sizing *sz, int n)
+{
+  int b = pow2_bucket (n);
+  if (b >= CBUFF_BUCKETS)
+    b = CBUFF_BUCKETS - 1;
+  if (sz->total >= SIZING_LIMIT) {
+    sz->total = 0;
+    for (int i=0 ; i<CBUFF_BUCKETS ; i++) {
+      sz->hist[i] /= 2;
+      sz->total += sz->hist[i];
     }
-  syslog (LOG_DEBUG, "did not find delimiter in buffer");
-  return 0;
+  }
+  sz->hist[b]++;
+  sz->total++;
 }
 
-int cbuf_findtiu (struct cbuff *cb)
+// returns a power of two size that holds pct percent of the records
+// seen, or 0 if none have been
+int cbuf_suggest (struct cbuff_sizing *sz, int pct)
 {
-  syslog (LOG_DEBUG, "cbuf_findtiu: searching buffer for EOD");
-  return cbuf_find (cb, 0x4d);
+  if (!sz->total)
+    return 0;
+  unsigned want = (sz->total * pct + 99) / 100;
+  unsigned seen = 0;
+  for (int b=0 ; b<CBUFF_BUCKETS ; b++) {
+    seen += sz->hist[b];
+    if (seen >= want)
+      return 1 << b;
+  }
+  return 1 << (CBUFF_BUCKETS - 1);
+}
+
+// size for a buffer that filled up without holding a complete record:
+// at least double, or straight to the usual record size if that's
+// bigger.  returns -1 if the buffer is already at its limit.
+int cbuf_grow_size (struct cbuff *cb, struct cbuff_policy *p, struct cbuff_sizing *sz)
+{
+  if (p->max && cb->len >= p->max)
+    return -1;
+  int n = cb->len ? cb->len * 2 : p->init;
+  int s = cbuf_suggest (sz, SIZING_PERCENT);
+  if (s > n)
+    n = s;
+  if (p->max && n > p->max)
+    n = p->max;
+  return n;
 }
 
-int cbuf_finduit (struct cbuff *cb)
+// give back memory from a buffer that has gone quiet, keeping its
+// content and at least p->min bytes
+int cbuf_shrink (struct cbuff *cb, struct cbuff_policy *p)
 {
-  syslog (LOG_DEBUG, "cbuf_finduit: return %d bytes available", cb->len - cb->left);
-  return (cb->len - cb->left);
+  int n = 1 << pow2_bucket (cb->len - cb->left);
+  if (n < p->min)
+    n = p->min;
+  if (n >= cb->len)
+    return 0;
+  syslog (LOG_DEBUG, "cbuf_shrink: shrinking idle buffer from %d to %d bytes", cb->len, n);
+  return resize_cbuff (cb, n);
 }
@@ -1,3 +1,5 @@
+struct iovec;
+
 struct cbuff {
   char* buff;
   int start;
@@ -6,13 +8,35 @@ struct cbuff {
   int left;
 };
 
+// bounds on a buffer's size.  buffers start at init, never grow past
+// max (0 for no limit) and are not shrunk below min.
+struct cbuff_policy {
+  int init;
+  int min;
+  int max;
+};
+
+#define CBUFF_BUCKETS  32
+#define SIZING_PERCENT 90     // buffers are sized for this share of records
+
+// histogram of record sizes by power of two, halved whenever it fills
+// up so that it follows recent traffic
+struct cbuff_sizing {
+  unsigned short hist[CBUFF_BUCKETS];
+  unsigned total;
+};
+
 int new_cbuff (struct cbuff *cb, int n);
 int free_cbuff (struct cbuff *cb);
 int resize_cbuff (struct cbuff *cb, int n);
+int cbuf_reserve (int count, int size);
 int read2cbuf (struct cbuff *cb, int fd);
 int cbuf2write (struct cbuff *cb, int fd, int n);
-int cbuf2buf (struct cbuff *cb, char* buf, int n);
 int buf2cbuf (struct cbuff *cb, char* buf, int n);
-int cbuf_find (struct cbuff *cb, char c);
-int cbuf_findtiu (struct cbuff *cb);
-int cbuf_finduit (struct cbuff *cb);
+int dump_cbuf (struct cbuff *cb);
+int cbuf_iov (struct cbuff *cb, int n, struct iovec *iov);
+int cbuf_discard (struct cbuff *cb, int n);
+void cbuf_note_record (struct cbuff_sizing *sz, int n);
+int cbuf_suggest (struct cbuff_sizing *sz, int pct);
+int cbuf_grow_size (struct cbuff *cb, struct cbuff_policy *p, struct cbuff_sizing *sz);
+int cbuf_shrink (struct cbuff *cb, struct cbuff_policy *p);
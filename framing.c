@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "cbuff.h"
+#include "framing.h"
+
+#define SLIP_END   0xc0
+#define COBS_END   0x00
+#define HDLC_FLAG  0x7e
+
+// each scanner examines n contiguous bytes of the ring and returns how
+// many it consumed, setting *done if that completed a record.  state
+// carries across calls, so a record split over reads or over the wrap
+// of the ring is never rescanned.
+
+static int scan_delim (struct framer *f, const unsigned char *p, int n, int *done)
+{
+  const unsigned char *q = memchr (p, f->fr->flag, n);
+  if (!q)
+    return n;
+  *done = 1;
+  return q - p + 1;
+}
+
+// slip, cobs and hdlc all stuff the flag byte out of the payload, so a
+// record ends at the first flag that follows some payload.  leading
+// flags (slip and hdlc senders may open a frame with one) are kept
+// with the record that follows them.
+static int scan_stuffed (struct framer *f, const unsigned char *p, int n, int *done)
+{
+  int i = 0;
+  if (f->state == 0) {
+    while (i < n && p[i] == f->fr->flag)
+      i++;
+    if (i == n)
+      return n;
+    f->state = 1;
+  }
+  const unsigned char *q = memchr (p + i, f->fr->flag, n - i);
+  if (!q)
+    return n;
+  *done = 1;
+  return q - p + 1;
+}
+
+static int scan_length (struct framer *f, const unsigned char *p, int n, int *done)
+{
+  const struct framing *fr = f->fr;
+  int i = 0;
+  while (f->hdr < fr->hdrlen && i < n) {
+    if (f->hdr >= fr->lenoff && f->hdr < fr->lenoff + fr->lenwidth)
+      f->need = (f->need << 8) | p[i];
+    f->hdr++;
+    i++;
+  }
+  if (f->hdr < fr->hdrlen)
+    return i;
+  if (f->need > FRAME_MAXLEN) {
+    syslog (LOG_ERR, "record length %lu exceeds maximum %d", f->need, FRAME_MAXLEN);
+    return -1;
+  }
+  // payload is skipped over, not examined
+  int skip = (f->need < (unsigned long) (n - i)) ? (int) f->need : n - i;
+  f->need -= skip;
+  i += skip;
+  if (!f->need)
+    *done = 1;
+  return i;
+}
+
+static const struct {
+  const char *name;
+  int (*scan) (struct framer *f, const unsigned char *p, int n, int *done);
+} framings[] = {
+  [FRAME_RAW]    = { "raw",    NULL },
+  [FRAME_DELIM]  = { "delim",  scan_delim },
+  [FRAME_LENGTH] = { "length", scan_length },
+  [FRAME_SLIP]   = { "slip",   scan_stuffed },
+  [FRAME_COBS]   = { "cobs",   scan_stuffed },
+  [FRAME_HDLC]   = { "hdlc",   scan_stuffed },
+};
+
+// spec is one of raw, delim[:<char>|<num>], length[:1|2|4], slip, cobs
+// or hdlc.  returns 0 on success, -1 if spec isn't understood.
+int parse_framing (struct framing *fr, const char *spec)
+{
+  const char *arg = strchr (spec, ':');
+  size_t n = arg ? (size_t) (arg++ - spec) : strlen (spec);
+  int kind;
+
+  for (kind = 0 ; kind < (int) (sizeof(framings) / sizeof(framings[0])) ; kind++)
+    if (strlen (framings[kind].name) == n && !strncmp (spec, framings[kind].name, n))
+      break;
+
+  memset (fr, 0, sizeof(*fr));
+  fr->kind = kind;
+
+  switch (kind) {
+  case FRAME_RAW:
+    break;
+  case FRAME_DELIM:
+    fr->flag = '\n';
+    if (arg && strlen (arg) == 1) {
+      fr->flag = arg[0];
+    } else if (arg) {
+      char *end;
+      errno = 0;
+      unsigned long c = strtoul (arg, &end, 0);
+      if (errno || *end || c > 0xff)
+	return -1;
+      fr->flag = c;
+    }
+    break;
+  case FRAME_LENGTH:
+    fr->lenwidth = arg ? atoi (arg) : 2;
+    if (fr->lenwidth != 1 && fr->lenwidth != 2 && fr->lenwidth != 4)
+      return -1;
+    fr->hdrlen = fr->lenwidth;
+    fr->lenoff = 0;
+    break;
+  case FRAME_SLIP:
+    fr->flag = SLIP_END;
+    break;
+  case FRAME_COBS:
+    fr->flag = COBS_END;
+    break;
+  case FRAME_HDLC:
+    fr->flag = HDLC_FLAG;
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+const char* framing_name (const struct framing *fr)
+{
+  return framings[fr->kind].name;
+}
+
+void framer_init (struct framer *f, const struct framing *fr)
+{
+  memset (f, 0, sizeof(*f));
+  f->fr = fr;
+}
+
+// returns the size of the complete record at the start of cb, 0 if
+// there isn't one yet, or -1 if the stream can't be framed.
+int framer_next (struct framer *f, struct cbuff *cb)
+{
+  if (f->record)
+    return f->record;
+
+  int csize = cb->len - cb->left;
+
+  if (f->fr->kind == FRAME_RAW) {
+    // unframed, whatever has arrived is a record
+    f->scanned = f->record = csize;
+    return f->record;
+  }
+
+  while (f->scanned < csize) {
+    int pos = (cb->start + f->scanned) % cb->len;
+    int n = cb->len - pos;
+    if (n > csize - f->scanned)
+      n = csize - f->scanned;
+    int done = 0;
+    int m = framings[f->fr->kind].scan (f, (unsigned char *) cb->buff + pos, n, &done);
+    if (m < 0)
+      return -1;
+    f->scanned += m;
+    if (done) {
+      f->record = f->scanned;
+      break;
+    }
+  }
+  return f->record;
+}
+
+// n bytes have been taken from the start of the cbuff
+void framer_consume (struct framer *f, int n)
+{
+  f->scanned -= n;
+  f->record -= n;
+  // scanning stops at the end of a record, so once it has been taken
+  // the next one is parsed from its beginning
+  if (f->record <= 0)
+    framer_init (f, f->fr);
+}
+
+// n bytes of a record that isn't complete yet have been taken from the
+// start of the cbuff, as when a record too big for its buffer is passed
+// on in pieces.  parsing carries on where it was, so the rest of the
+// record isn't taken for the start of another.
+void framer_skip (struct framer *f, int n)
+{
+  f->scanned -= n;
+}
+
+// give up waiting for the rest of a record and treat whatever has
+// arrived as one.  returns the size of the record.
+int framer_flush (struct framer *f, struct cbuff *cb)
+{
+  if (!f->record)
+    f->scanned = f->record = cb->len - cb->left;
+  return f->record;
+}
+
+// a length-prefixed record can't be cut short, what follows the cut
+// would be taken for the next header
+int framer_can_flush (const struct framer *f)
+{
+  return f->fr->kind != FRAME_LENGTH;
+}
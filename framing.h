@@ -0,0 +1,41 @@
+#define FRAME_RAW     0
+#define FRAME_DELIM   1
+#define FRAME_LENGTH  2
+#define FRAME_SLIP    3
+#define FRAME_COBS    4
+#define FRAME_HDLC    5
+
+#define FRAME_MAXLEN  (1 << 24)
+
+// how records are recognized in a stream.  the payload is never
+// decoded, mux2tty only needs to know where each record ends so
+// that records from different sessions aren't interleaved.
+struct framing {
+  int kind;
+  unsigned char flag;   // delimiter, or frame flag for slip/cobs/hdlc
+  int hdrlen;           // length-prefixed: size of header
+  int lenoff;           // length-prefixed: offset of length in header
+  int lenwidth;         // length-prefixed: 1, 2 or 4 bytes, big-endian
+};
+
+// streaming parser state for one cbuff.  scanned counts the bytes
+// past cb->start already examined, so each byte is looked at once.
+struct framer {
+  const struct framing *fr;
+  int state;
+  int scanned;
+  int record;           // size of complete record at cb->start, 0 if none
+  int hdr;              // length-prefixed: header bytes seen
+  unsigned long need;   // length-prefixed: length, then payload bytes to skip
+};
+
+struct cbuff;
+
+int parse_framing (struct framing *fr, const char *spec);
+const char* framing_name (const struct framing *fr);
+void framer_init (struct framer *f, const struct framing *fr);
+int framer_next (struct framer *f, struct cbuff *cb);
+void framer_consume (struct framer *f, int n);
+void framer_skip (struct framer *f, int n);
+int framer_flush (struct framer *f, struct cbuff *cb);
+int framer_can_flush (const struct framer *f);
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "cbuff.h"
+#include "cbuff-model.h"
+
+// libFuzzer entry point: the input is a ring size and a sequence of
+// operations, checked against the model.  built with --enable-fuzzing
+// it runs under libFuzzer, otherwise the main below replays files or,
+// with none given, a fixed set of random inputs.
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  setlogmask (LOG_UPTO (LOG_CRIT));
+  if (model_run (data, size > 65536 ? 65536 : (int) size) < 0)
+    abort ();
+  return 0;
+}
+
+#ifndef FUZZING
+int main (int argc, char **argv)
+{
+  static unsigned char buf[65536];
+
+  for (int i=1 ; i<argc ; i++) {
+    FILE *f = fopen (argv[i], "r");
+    if (!f) {
+      perror (argv[i]);
+      return 1;
+    }
+    size_t n = fread (buf, 1, sizeof(buf), f);
+    fclose (f);
+    LLVMFuzzerTestOneInput (buf, n);
+  }
+  if (argc == 1) {
+    srandom (2);
+    for (int run=0 ; run<1000 ; run++) {
+      size_t n = random () % 4096;
+      for (size_t i=0 ; i<n ; i++)
+	buf[i] = random ();
+      LLVMFuzzerTestOneInput (buf, n);
+    }
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+
+#include "cbuff.h"
+#include "framing.h"
+#include "mux.h"
+#include "handoff.h"
+
+// a running mux2tty listens on a UNIX socket; a new one started with
+// the same --handoff path connects to it and is sent the tty, the
+// listeners and every session with its buffered data.  SOCK_SEQPACKET
+// keeps each descriptor attached to its own message.
+
+static int handoff_addr (struct sockaddr_un *sun, const char *path)
+{
+  memset (sun, 0, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof(sun->sun_path)) {
+    syslog (LOG_ERR, "handoff path %s too long", path);
+    return -1;
+  }
+  strcpy (sun->sun_path, path);
+  return 0;
+}
+
+int handoff_listen (const char *path)
+{
+  struct sockaddr_un sun;
+  if (handoff_addr (&sun, path) < 0)
+    return -1;
+
+  int fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    syslog (LOG_ERR, "%m: handoff socket failed");
+    return -2;
+  }
+
+  // the path belonged to the process we took over, or is stale
+  unlink (path);
+
+  if (bind (fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 ||
+      listen (fd, 1) == -1) {
+    syslog (LOG_ERR, "%m: listening on handoff socket %s failed", path);
+    close (fd);
+    return -3;
+  }
+  return fd;
+}
+
+// handoff sockets block, so that a process that stops answering
+// partway through doesn't leave the other one stuck for good
+int handoff_timeout (int sock)
+{
+  struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+  if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+      setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+    syslog (LOG_ERR, "%m: setting handoff timeouts failed");
+    return -1;
+  }
+  return 0;
+}
+
+// returns a connection to the running process, or -1 if there isn't one
+int handoff_connect (const char *path)
+{
+  struct sockaddr_un sun;
+  if (handoff_addr (&sun, path) < 0)
+    return -1;
+
+  int fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+    syslog (LOG_DEBUG, "%m: no process to take over at %s", path);
+    close (fd);
+    return -1;
+  }
+  if (handoff_timeout (fd) < 0) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int send_chunk (int sock, struct iovec *iov, int iovcnt, int fd)
+{
+  char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  if (fd >= 0) {
+    memset (cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy (CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  if (sendmsg (sock, &msg, MSG_NOSIGNAL) == -1) {
+    syslog (LOG_ERR, "%m: handoff send failed");
+    return -1;
+  }
+  return 0;
+}
+
+// send the first n bytes of cb, which are left in place
+static int send_cbuff (int sock, struct cbuff *cb, int n)
+{
+  struct iovec iov[2];
+  int iovcnt = n ? cbuf_iov (cb, n, iov) : 0;
+
+  for (int i=0 ; i<iovcnt ; i++) {
+    char *p = iov[i].iov_base;
+    size_t n = iov[i].iov_len;
+    while (n) {
+      struct iovec c = { p, n < HANDOFF_CHUNK ? n : HANDOFF_CHUNK };
+      if (send_chunk (sock, &c, 1, -1) < 0)
+	return -1;
+      p += c.iov_len;
+      n -= c.iov_len;
+    }
+  }
+  return 0;
+}
+
+// send m with fd attached (unless fd < 0), followed by the contents of
+// cb and then of out, either of which may be NULL
+int handoff_send (int sock, struct handoff_msg *m, int fd, struct cbuff *cb, struct cbuff *out)
+{
+  struct iovec iov;
+
+  m->version = HANDOFF_VERSION;
+  m->len = cb ? cb->len - cb->left : 0;
+  m->outlen = out ? out->len - out->left : 0;
+
+  iov.iov_base = m;
+  iov.iov_len = sizeof(*m);
+  if (send_chunk (sock, &iov, 1, fd) < 0 ||
+      send_cbuff (sock, cb, m->len) < 0 ||
+      send_cbuff (sock, out, m->outlen) < 0)
+    return -1;
+  return 0;
+}
+
+// receive the next message; *fd is the descriptor that came with it,
+// or -1.  the caller collects m->len and then m->outlen bytes with
+// handoff_recv_cbuff().
+int handoff_recv (int sock, struct handoff_msg *m, int *fd)
+{
+  char cmsgbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { m, sizeof(*m) };
+  struct msghdr msg;
+
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof(cmsgbuf);
+
+  *fd = -1;
+  ssize_t n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n != sizeof(*m) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+    syslog (LOG_ERR, "short handoff message (%zd bytes)", n);
+    return -1;
+  }
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg) ; cmsg ; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy (fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if (m->version != HANDOFF_VERSION) {
+    syslog (LOG_ERR, "handoff version %d, expected %d", m->version, HANDOFF_VERSION);
+    if (*fd >= 0)
+      close (*fd);
+    return -1;
+  }
+  return 0;
+}
+
+// append len bytes of handed off data to cb, which must have room
+int handoff_recv_cbuff (int sock, struct cbuff *cb, int len)
+{
+  char buf[HANDOFF_CHUNK];
+
+  while (len > 0) {
+    ssize_t n = recv (sock, buf, sizeof(buf), 0);
+    if (n <= 0 || n > len) {
+      syslog (LOG_ERR, "handoff data ended with %d bytes missing", len);
+      return -1;
+    }
+    if (buf2cbuf (cb, buf, n) != n)
+      return -1;
+    len -= n;
+  }
+  return 0;
+}
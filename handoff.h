@@ -0,0 +1,45 @@
+#include <termios.h>
+#include <linux/serial.h>
+
+#define HANDOFF_VERSION   3
+#define HANDOFF_CHUNK     16384
+#define HANDOFF_TIMEOUT   5       // seconds either side waits for the other
+
+#define HANDOFF_TTY       1
+#define HANDOFF_LISTENER  2
+#define HANDOFF_SESSION   3
+#define HANDOFF_DONE      4
+
+#define HANDOFF_CLOSED    0x01   // session had closed, only its records remain
+#define HANDOFF_PENDING   0x02   // session's record is partially written
+#define HANDOFF_LAST      0x04   // session last served by the round-robin
+#define HANDOFF_SUBSCRIBER 0x08  // session only receives
+#define HANDOFF_MUX       0x10   // session is multiplexed
+#define HANDOFF_REPLY     0x20   // the tty's next record answers this session
+
+// for HANDOFF_LISTENER, flags carries the listener's mode
+
+// one message per descriptor, carried with SCM_RIGHTS, followed by
+// len bytes of buffered data and then outlen bytes of tty records the
+// session hasn't taken yet, in messages of up to HANDOFF_CHUNK
+struct handoff_msg {
+  int version;
+  int type;
+  int flags;
+  int len;
+  int outlen;
+  struct framer fr;                  // parse state of buffered data
+  struct mux mux;                    // HANDOFF_MUX: channel weights and reply
+  struct termios save;               // HANDOFF_TTY: settings to restore
+  int serial_saved;
+  struct serial_struct serial_save;
+};
+
+struct cbuff;
+
+int handoff_listen (const char *path);
+int handoff_connect (const char *path);
+int handoff_timeout (int sock);
+int handoff_send (int sock, struct handoff_msg *m, int fd, struct cbuff *cb, struct cbuff *out);
+int handoff_recv (int sock, struct handoff_msg *m, int *fd);
+int handoff_recv_cbuff (int sock, struct cbuff *cb, int len);
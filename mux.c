@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/uio.h>
+
+#include "cbuff.h"
+#include "framing.h"
+#include "mux.h"
+
+const struct framing mux_framing = { FRAME_LENGTH, 0, MUX_HDRLEN, 4, 4 };
+
+// decode the header of the frame at the start of cb, which the framer
+// has already found to be complete, along with the first byte of its
+// payload if it has one.  returns the size of the whole frame.
+int mux_peek (struct cbuff *cb, struct mux_hdr *h, unsigned char *arg)
+{
+  unsigned char p[MUX_HDRLEN + 1];
+  struct iovec iov[2];
+  int csize = cb->len - cb->left;
+  int n = csize < (int) sizeof(p) ? csize : (int) sizeof(p);
+  int iovcnt = cbuf_iov (cb, n, iov);
+
+  memcpy (p, iov[0].iov_base, iov[0].iov_len);
+  if (iovcnt > 1)
+    memcpy (p + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+  h->type = p[0];
+  h->flags = p[1];
+  h->channel = (p[2] << 8) | p[3];
+  h->len = ((unsigned long) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+  *arg = (h->len && n > MUX_HDRLEN) ? p[MUX_HDRLEN] : 0;
+  return MUX_HDRLEN + h->len;
+}
+
+void mux_encode (unsigned char *p, const struct mux_hdr *h)
+{
+  p[0] = h->type;
+  p[1] = h->flags;
+  p[2] = h->channel >> 8;
+  p[3] = h->channel;
+  p[4] = h->len >> 24;
+  p[5] = h->len >> 16;
+  p[6] = h->len >> 8;
+  p[7] = h->len;
+}
+
+// index of channel's entry in the weight table, or -1
+static int find_weight (const struct mux *m, unsigned short channel)
+{
+  for (int i=0 ; i<m->nweights ; i++)
+    if (m->weight[i].channel == channel)
+      return i;
+  return -1;
+}
+
+static void drop_weight (struct mux *m, unsigned short channel)
+{
+  int i = find_weight (m, channel);
+  if (i >= 0)
+    m->weight[i] = m->weight[--m->nweights];
+}
+
+int mux_weight (const struct mux *m, unsigned short channel)
+{
+  int i = find_weight (m, channel);
+  return i < 0 ? 1 : m->weight[i].weight;
+}
+
+// act on a frame that carries no data for the tty.  returns -1 if the
+// frame can't be acted on, which only costs the channel its weight.
+int mux_control (struct mux *m, const struct mux_hdr *h, unsigned char arg)
+{
+  int i;
+
+  switch (h->type) {
+  case MUX_WEIGHT:
+    // a weight of 0 or 1 is the default and needs no entry
+    if (arg <= 1) {
+      drop_weight (m, h->channel);
+    } else if ((i = find_weight (m, h->channel)) >= 0) {
+      m->weight[i].weight = arg;
+    } else if (m->nweights == MUX_WEIGHTS) {
+      syslog (LOG_ERR, "no room for a weight on channel %d, %d channels have one",
+	      h->channel, MUX_WEIGHTS);
+      return -1;
+    } else {
+      m->weight[m->nweights].channel = h->channel;
+      m->weight[m->nweights++].weight = arg;
+    }
+    syslog (LOG_DEBUG, "channel %d weight %d", h->channel, arg);
+    return 0;
+  case MUX_CLOSE:
+    drop_weight (m, h->channel);
+    if (m->reply == h->channel)
+      m->reply = MUX_BROADCAST;
+    syslog (LOG_DEBUG, "channel %d closed", h->channel);
+    return 0;
+  }
+  syslog (LOG_ERR, "unknown frame type %d on channel %d", h->type, h->channel);
+  return -1;
+}
+
+void mux_free (struct mux *m)
+{
+  memset (m, 0, sizeof(*m));
+}
@@ -0,0 +1,45 @@
+#define MUX_HDRLEN     8
+
+#define MUX_DATA       0   // payload is one record for or from the tty
+#define MUX_WEIGHT     1   // first payload byte is the channel's weight
+#define MUX_CLOSE      2   // channel is finished with
+
+#define MUX_BROADCAST  0   // channel of tty records that answer no one
+
+// every frame on a multiplexed connection starts with a fixed header,
+// big-endian on the wire:
+//
+//   type (1)  flags (1)  channel (2)  length of payload (4)
+//
+// so frames are found with plain length-prefixed framing and the
+// payload is forwarded straight out of the ring.
+struct mux_hdr {
+  unsigned char type;
+  unsigned char flags;
+  unsigned short channel;
+  unsigned long len;
+};
+
+#define MUX_WEIGHTS    16  // channels per connection that may set a weight
+
+// per-connection channel state.  channels without an entry have a
+// weight of 1, and few ever set one, so the table is small and kept
+// in the session rather than allocated.
+struct mux {
+  struct {
+    unsigned short channel;
+    unsigned char weight;      // records per turn
+  } weight[MUX_WEIGHTS];
+  int nweights;
+  unsigned short reply;      // channel whose record last went to the tty
+};
+
+struct cbuff;
+
+extern const struct framing mux_framing;
+
+int mux_peek (struct cbuff *cb, struct mux_hdr *h, unsigned char *arg);
+void mux_encode (unsigned char *p, const struct mux_hdr *h);
+int mux_weight (const struct mux *m, unsigned short channel);
+int mux_control (struct mux *m, const struct mux_hdr *h, unsigned char arg);
+void mux_free (struct mux *m);
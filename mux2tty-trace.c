@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+
+#include "trace.h"
+
+// turns a trace dumped by mux2tty into a timeline, oldest event first
+
+const char *argp_program_version = "mux2tty-trace 0.1";
+const char *argp_program_bug_address = "mux2tty-bugs@klickitat.com";
+
+static char doc[] =
+  "mux2tty-trace prints a trace dumped by mux2tty\v\
+mux2tty records its events in memory and writes them out on SIGUSR1 or \
+when it crashes.  Times are in ms before the dump, followed by the time \
+since the previous event.";
+
+int fd_only = -1;
+char *tracefn = NULL;
+
+static int
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  switch (key)
+    {
+    case 'f':
+      fd_only = atoi (arg);
+      break;
+
+    case ARGP_KEY_ARG:
+      if (tracefn)
+	argp_usage (state);
+      tracefn = arg;
+      break;
+
+    case ARGP_KEY_END:
+      if (!tracefn)
+	argp_usage (state);
+      break;
+    }
+  return 0;
+}
+
+int main(int argc,char** argv)
+{
+  struct argp_option options[] = {
+    { "fd", 'f', "<fd>", 0, "Only show events for fd" },
+    { 0 }
+  };
+  struct argp argp = { options, parse_opt, "<trace>", doc };
+  struct trace_header h;
+
+  argp_parse (&argp, argc, argv, 0, 0, NULL);
+
+  FILE *f = fopen (tracefn, "r");
+  if (!f) {
+    perror (tracefn);
+    return 1;
+  }
+  if (fread (&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC) {
+    fprintf (stderr, "%s is not a mux2tty trace\n", tracefn);
+    return 1;
+  }
+  if (h.version != TRACE_VERSION || h.size != sizeof(struct trace_event) ||
+      !h.events || (h.events & (h.events - 1))) {
+    fprintf (stderr, "%s is trace version %u, expected %u\n", tracefn, h.version, TRACE_VERSION);
+    return 1;
+  }
+
+  struct trace_event *ev = calloc (h.events, sizeof(struct trace_event));
+  if (!ev || fread (ev, sizeof(struct trace_event), h.events, f) != h.events) {
+    fprintf (stderr, "%s is truncated\n", tracefn);
+    return 1;
+  }
+  fclose (f);
+
+  // ticks per ns, from the two points where both clocks were read
+  double scale = h.ns1 > h.ns0 ? (double) (h.clk1 - h.clk0) / (h.ns1 - h.ns0) : 1.0;
+  if (scale <= 0)
+    scale = 1.0;
+
+  unsigned long long first = h.head > h.events ? h.head - h.events : 0;
+  unsigned long long prev = 0;
+
+  printf ("%llu events recorded, %llu shown\n", h.head, h.head - first);
+  for (unsigned long long i = first ; i < h.head ; i++) {
+    struct trace_event *e = &ev[i & (h.events - 1)];
+    if (fd_only >= 0 && e->fd != fd_only)
+      continue;
+    double before = (double) (long long) (h.clk1 - e->ts) / scale / 1e6;
+    double delta = prev ? (double) (long long) (e->ts - prev) / scale / 1e3 : 0;
+    prev = e->ts;
+    printf ("%14.6f ms  %+10.3f us  fd %4d  %-10s %d\n",
+	    -before, delta, e->fd, trace_name (e->type), e->arg);
+  }
+  free (ev);
+  return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,6 +11,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include <sys/time.h>
 #include <sys/select.h>
@@ -17,6 +21,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 #include <time.h>
@@ -25,6 +30,13 @@
 #include <signal.h>
 
 #include "cbuff.h"
+#include "framing.h"
+#include "mux.h"
+#include "handoff.h"
+#include "timer.h"
+#include "realtime.h"
+#include "trace.h"
+#include "rate.h"
 
 const char *argp_program_version = "mux2tty 0.1";
 const char *argp_program_bug_address = "mux2tty-bugs@klickitat.com";
@@ -33,9 +45,9 @@ static char doc[] =
   "mux2tty opens a tty and listens on a TCP port for connections\v\
 Data from TCP connections are sent to the tty.  Data from the tty are sent to all \
 TCP connections.  By default, data are line-buffered and input from connections are \
-is round-robined.  Turn off round-robining using --fifo.  Turn off buffering \
-with --delimiter with no argument.  Buffer on something other than lines using the \
---delimiter option with a string argument";
+is round-robined.  Records are recognized using --framing, one of raw, \
+delim[:<char>], length[:1|2|4], slip, cobs or hdlc.  Data from the tty are \
+forwarded as they arrive unless --tty-framing is given.";
 
 
 #define DEFAULT_DEBUG_LEVEL  0xffffffff
@@ -46,21 +58,167 @@ unsigned long debug = 0;
 int nofork = 0;
 int hardware_flowctrl = 0;
 
-#define LINE_BUFFERING  1
-#define TIU_BUFFERING   2
+#define TTY_DEFAULT     0
+#define TTY_THROUGHPUT  1
+#define TTY_LATENCY     2
+
+int tty_profile = TTY_DEFAULT;
+int tty_vmin = 64;
+int tty_idle = 0;       // throughput mode, VMIN is 1 until data arrives
+int tty_busy = 0;       // throughput mode, read from since the last pass
+int baud = 0;
+
+int pacing = 0;
+int pace_ms = 0;
+
+int realtime = 0;
+struct realtime rt;
+int rt_bufsize = 0;     // size of the preallocated session buffers
+int rt_backlog = 0;     // and of the preallocated backlogs
 
 #define CBUFFSIZE      64
+#define PRESIZE_LIMIT  4       // new sessions start at up to this many times init without a max
+#define ACCEPT_BUDGET  64
+#define BACKLOG_MAX    (1 << 20)
+#define RT_BACKLOG     4       // tty buffers a session may be behind in real-time mode
+
+#define TIU_EOD        0x4d
 
-int buffering = LINE_BUFFERING;
-char delim = '\n';
+struct framing session_framing = { FRAME_DELIM, '\n' };
+struct framing tty_framing = { FRAME_RAW };
 
 int tty = 0;
 
 char* ttystr = NULL;
 char* baudstr = "57600";
 char* portstr = "4660";
+char* subportstr = NULL;
+char* muxportstr = NULL;
+char* tracestr = NULL;
+
+int max_sessions = 0;
+
+struct cbuff_policy session_policy = { CBUFFSIZE, CBUFFSIZE, 0 };
+struct cbuff_policy tty_policy = { CBUFFSIZE, CBUFFSIZE, 0 };
+int shrink_idle = 0;
+
+struct rate session_rate = { 0, 0 };
+struct rate listener_rate = { 0, 0 };
+
+int idle_timeout = 0;
+int flush_timeout = 0;
+int stall_timeout = 0;
+int stats_interval = 0;
+
+struct timer_wheel timers;
+struct timer shrink_timer;
+struct timer stats_timer;
+
+unsigned long long bytes_to_tty = 0;
+unsigned long long bytes_from_tty = 0;
+unsigned long long records_to_tty = 0;
+unsigned long long evictions = 0;
+
+char* handoffstr = NULL;
+int handoff_fd = -1;
+int handed_off = 0;
 
 struct termios tp, save;
+struct serial_struct serial_save;
+int serial_saved = 0;
+
+// per-fd state, indexed by fd.  the peer address is kept as accepted
+// and only formatted by session_name() when a log message needs it.
+struct session {
+  struct cbuff cb;
+  struct cbuff out;     // tty records a slow reader hasn't taken yet
+  struct framer fr;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int holder;           // fd is only kept open to hold the slot of a closed session
+  int listener;         // index in listeners of the listener it came from
+  struct cbuff_sizing sz;
+  long long active;     // when data last arrived, in ms
+  struct timer idle;    // reaps sessions that send nothing
+  struct timer flush;   // forwards a record left unfinished
+  struct timer stall;   // evicts sessions that stop reading
+  struct mux mux;       // channels of a multiplexed session
+  struct bucket bucket; // against session_rate
+};
+
+#define LISTEN_DATA       0
+#define LISTEN_SUBSCRIBE  1   // sessions only receive, nothing is read from them
+#define LISTEN_MUX        2   // sessions carry many channels, see mux.h
+
+#define MAX_LISTENERS     4
+
+struct listener {
+  int fd;
+  int mode;
+  struct cbuff_policy policy;
+  struct cbuff_sizing sz;     // records from all of its sessions
+  struct bucket bucket;       // against listener_rate, shared by its sessions
+};
+
+struct listener listeners[MAX_LISTENERS];
+int nlisteners = 0;
+
+// sessions with an fd at or past FD_SETSIZE are refused, so the table
+// is fixed and a session's timers never move
+struct session sess[FD_SETSIZE];
+
+fd_set sessions;
+fd_set closed;
+fd_set subscribers;
+int nsessions = 0;
+int maxfd = 0;
+int last = 0;
+int pending = 0;
+int reply_to = -1;      // multiplexed session whose record last went to the tty
+
+const char* session_name(int fd)
+{
+  static char name[NI_MAXHOST + NI_MAXSERV + 1];
+  char hostname[NI_MAXHOST];
+  char service[NI_MAXSERV];
+
+  if (!sess[fd].addrlen ||
+      getnameinfo((struct sockaddr *) &sess[fd].addr,sess[fd].addrlen,
+		  hostname,NI_MAXHOST,
+		  service,NI_MAXSERV,
+		  NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    snprintf (name, sizeof(name), "fd %d", fd);
+  } else {
+    snprintf (name, sizeof(name), "%s:%s", hostname, service);
+  }
+  return name;
+}
+
+long long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// <init>[:<min>:<max>]
+int parse_policy(struct cbuff_policy *p, char *arg)
+{
+  char *end;
+  p->init = strtoul (arg, &end, 0);
+  p->min = p->init;
+  p->max = 0;
+  if (*end == ':') {
+    p->min = strtoul (end + 1, &end, 0);
+    if (*end != ':')
+      return -1;
+    p->max = strtoul (end + 1, &end, 0);
+  }
+  if (*end || p->init <= 0 || p->min <= 0 ||
+      (p->max && (p->max < p->init || p->max < p->min)))
+    return -1;
+  return 0;
+}
 
 int max_fds(fd_set *set,int start) 
 {
@@ -78,9 +236,169 @@ int max_fds2(fd_set *set1, fd_set *set2, int start)
   return max;
 }
 
-int validate_terminal(char*,char*);
+// time for the driver to collect a throughput batch at the configured
+// baud, assuming 10 bits per byte on the wire
+long tty_batch_usec(void)
+{
+  long usec = baud ? 10000000L * tty_vmin / baud : 100000;
+  if (usec < 1000)
+    usec = 1000;
+  if (usec > 100000)
+    usec = 100000;
+  return usec;
+}
+
+// with pacing, records are only handed to the tty while its output
+// queue holds less than pace_ms worth of bytes at the configured baud,
+// or is empty when pace_ms is 0, so the scheduler and not the kernel
+// decides what goes out next.  returns 1 if the tty can take another
+// record, otherwise 0 with *usec set to about when it will.
+int tty_paced(int fd, long *usec)
+{
+  int q;
+  if (!pacing || ioctl(fd, TIOCOUTQ, &q) == -1)
+    return 1;
+
+  long budget = baud ? (long) pace_ms * baud / 10000 : 0;
+  if (q == 0 || q < budget)
+    return 1;
+
+  *usec = baud ? 10000000L * (q - budget + 1) / baud : 1000;
+  if (*usec < 1000)
+    *usec = 1000;
+  trace (TR_PACE,fd,*usec);
+  return 0;
+}
+
+// in throughput mode an idle tty has VMIN lowered to 1, or a burst
+// shorter than VMIN would sit in the driver without waking select
+void tty_set_idle(int idle)
+{
+  if (idle == tty_idle)
+    return;
+  tp.c_cc[VMIN] = idle ? 1 : tty_vmin;
+  if (tcsetattr(tty,TCSANOW,&tp) == 0)
+    tty_idle = idle;
+}
+
+// in latency mode, take everything the driver has in one pass so none
+// of it waits for another trip round the loop.  the tty buffer is grown
+// to fit it, within its limit and outside real-time mode.
+int read_tty_all(void)
+{
+  struct cbuff *cb = &sess[tty].cb;
+  int q, len, n;
+
+  if (!realtime && ioctl(tty,TIOCINQ,&q) == 0 && q > cb->left) {
+    int size = cb->len - cb->left + q;
+    if (tty_policy.max && size > tty_policy.max)
+      size = tty_policy.max;
+    if (size > cb->len && resize_cbuff(cb,size) == 0)
+      trace (TR_RESIZE,tty,size);
+  }
+  // a read stops at the end of the ring, the rest wraps to its start
+  len = read2cbuf(cb,tty);
+  while (len > 0 && cb->left && (n = read2cbuf(cb,tty)) > 0)
+    len += n;
+  return len;
+}
+
+int parse_tty_profile(char *arg)
+{
+  if (!strcmp (arg, "default")) {
+    tty_profile = TTY_DEFAULT;
+  } else if (!strcmp (arg, "latency")) {
+    tty_profile = TTY_LATENCY;
+  } else if (!strncmp (arg, "throughput", 10) && (!arg[10] || arg[10] == ':')) {
+    tty_profile = TTY_THROUGHPUT;
+    if (arg[10])
+      tty_vmin = atoi (arg + 11);
+    if (tty_vmin < 1 || tty_vmin > 255)
+      return -1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
 int validate_port(char*);
+
+// returns the index of the listener on fd, or -1
+int find_listener(int fd)
+{
+  for (int i=0 ; i<nlisteners ; i++)
+    if (listeners[i].fd == fd)
+      return i;
+  return -1;
+}
+
+int is_mux(int fd)
+{
+  return listeners[sess[fd].listener].mode == LISTEN_MUX;
+}
+
+// returns the index of the listener for mode, or -1
+int find_mode(int mode)
+{
+  for (int i=0 ; i<nlisteners ; i++)
+    if (listeners[i].mode == mode)
+      return i;
+  return -1;
+}
+
+int add_listener(int fd, int mode)
+{
+  if (nlisteners == MAX_LISTENERS) {
+    syslog (LOG_ERR, "too many listeners");
+    return -1;
+  }
+  memset (&listeners[nlisteners], 0, sizeof(struct listener));
+  listeners[nlisteners].fd = fd;
+  listeners[nlisteners].mode = mode;
+  listeners[nlisteners].policy = session_policy;
+  bucket_init(&listeners[nlisteners].bucket,&listener_rate,now_ms());
+  return nlisteners++;
+}
+
+// listen on portstr, <port>[,<init>[:<min>:<max>]], for sessions of the
+// given mode, unless a listener for that mode was handed over.  buffers
+// of its sessions follow the policy given with the port, or
+// --session-buffer.
+int open_listener(char *portstr, int mode)
+{
+  struct cbuff_policy policy = session_policy;
+  char *pol = strchr (portstr, ',');
+  if (pol) {
+    *pol++ = 0;
+    if (parse_policy(&policy,pol) < 0) {
+      syslog (LOG_ERR, "bad buffer size %s for port %s",pol,portstr);
+      return -1;
+    }
+  }
+
+  int li = find_mode(mode);
+  if (li < 0) {
+    int fd = validate_port(portstr);
+    if (fd < 0)
+      return fd;
+
+    if (verbose)
+      syslog (LOG_INFO, "port = %s ; port number = %d",portstr,fd);
+
+    li = add_listener(fd, mode);
+    if (li < 0)
+      return li;
+  }
+  listeners[li].policy = policy;
+  return li;
+}
+
+int validate_terminal(char*,char*);
+int configure_terminal(int,char*,int);
 int restore_tty(int fd);
+void start_session(int fd);
+void release_session(int fd);
+void shrink_idle_buffers(long long now);
 
 static int
 parse_opt (int key, char *arg, struct argp_state *state)
@@ -115,14 +433,44 @@ parse_opt (int key, char *arg, struct argp_state *state)
       hardware_flowctrl = 1;
       break;
 
+    case 'P':
+      pacing = 1;
+      if (arg) {
+	errno = 0;
+	pace_ms = strtoul (arg, NULL, 0);
+	if (errno)
+	  argp_usage (state);
+      }
+      break;
+
+    case 'r':
+      realtime = 1;
+      if (parse_realtime (&rt, arg) < 0)
+	argp_error (state, "bad real-time setting %s", arg);
+      break;
+
+    case 'R':
+      if (parse_tty_profile (arg) < 0)
+	argp_error (state, "unknown tty profile %s", arg);
+      break;
+
     case 'l':
-      buffering = LINE_BUFFERING;
-      delim = '\n';
+      parse_framing (&session_framing, "delim");
       break;
 
     case 't':
-      buffering = TIU_BUFFERING;
-      delim = 0x4d;
+      session_framing.kind = FRAME_DELIM;
+      session_framing.flag = TIU_EOD;
+      break;
+
+    case 'F':
+      if (parse_framing (&session_framing, arg) < 0)
+	argp_error (state, "unknown framing %s", arg);
+      break;
+
+    case 'T':
+      if (parse_framing (&tty_framing, arg) < 0)
+	argp_error (state, "unknown framing %s", arg);
       break;
 
     case 'v':
@@ -133,6 +481,69 @@ parse_opt (int key, char *arg, struct argp_state *state)
       quiet = 1;
       break;
 
+    case 's':
+      subportstr = arg;
+      break;
+
+    case 'M':
+      muxportstr = arg;
+      break;
+
+    case 'x':
+      tracestr = arg;
+      break;
+
+    case 'B':
+      if (parse_policy (&session_policy, arg) < 0)
+	argp_error (state, "bad buffer size %s", arg);
+      break;
+
+    case 'Y':
+      if (parse_policy (&tty_policy, arg) < 0)
+	argp_error (state, "bad buffer size %s", arg);
+      break;
+
+    case 'I':
+      shrink_idle = atoi (arg);
+      break;
+
+    case 'L':
+      if (parse_rate (&session_rate, arg) < 0)
+	argp_error (state, "bad rate %s", arg);
+      break;
+
+    case 'G':
+      if (parse_rate (&listener_rate, arg) < 0)
+	argp_error (state, "bad rate %s", arg);
+      break;
+
+    case 'i':
+      idle_timeout = atoi (arg);
+      break;
+
+    case 'u':
+      flush_timeout = atoi (arg);
+      break;
+
+    case 'w':
+      stall_timeout = atoi (arg);
+      break;
+
+    case 'S':
+      stats_interval = atoi (arg);
+      break;
+
+    case 'H':
+      handoffstr = arg;
+      break;
+
+    case 'm':
+      errno = 0;
+      max_sessions = strtoul (arg, NULL, 0);
+      if (errno)
+	argp_usage (state);
+      break;
+
     case ARGP_KEY_ARG:
       (*arg_count)++;
       switch (*arg_count) {
@@ -151,6 +562,10 @@ parse_opt (int key, char *arg, struct argp_state *state)
     case ARGP_KEY_END:
       if (*arg_count < 1 || *arg_count > 3)
 	argp_usage (state);
+      if (realtime && !max_sessions)
+	argp_error (state, "--realtime needs --max-sessions to size its buffers");
+      if (realtime && !session_policy.max)
+	argp_error (state, "--realtime needs a max in --session-buffer to size its buffers");
       break;
     }
   return 0;
@@ -168,13 +583,495 @@ static void
 remove_pid_file_on_exit(int status, void *arg)
 {
   char *pidfn = (char *) arg;
-  if (pidfn) {
+  if (pidfn && !handed_off) {
     syslog (LOG_INFO, "removing pid file %s",pidfn);
     unlink (pidfn);
   }
   return;
 }
 
+// hand everything over to the process connected on cs.  the tty,
+// listener and session descriptors are sent with their buffered data,
+// the tty records each session is still owed and its channel state;
+// returns 0 once the new process has confirmed it has them all.
+int handoff_give(int cs)
+{
+  struct handoff_msg m;
+  char ack;
+
+  syslog (LOG_INFO, "handing over to new process");
+  if (handoff_timeout(cs) < 0)
+    return -1;
+
+  memset (&m, 0, sizeof(m));
+  m.type = HANDOFF_TTY;
+  m.fr = sess[tty].fr;
+  m.save = save;
+  m.serial_saved = serial_saved;
+  m.serial_save = serial_save;
+  if (handoff_send(cs,&m,tty,&sess[tty].cb,NULL) < 0)
+    return -1;
+
+  for (int i=0 ; i<nlisteners ; i++) {
+    memset (&m, 0, sizeof(m));
+    m.type = HANDOFF_LISTENER;
+    m.flags = listeners[i].mode;
+    if (handoff_send(cs,&m,listeners[i].fd,NULL,NULL) < 0)
+      return -1;
+  }
+
+  for (int fd=0 ; fd<maxfd ; fd++) {
+    if (FD_ISSET (fd, &sessions)) {
+      memset (&m, 0, sizeof(m));
+      m.type = HANDOFF_SESSION;
+      m.fr = sess[fd].fr;
+      m.mux = sess[fd].mux;
+      m.flags = (FD_ISSET (fd, &closed) ? HANDOFF_CLOSED : 0) |
+	(pending == fd ? HANDOFF_PENDING : 0) |
+	(last == fd ? HANDOFF_LAST : 0) |
+	(FD_ISSET (fd, &subscribers) ? HANDOFF_SUBSCRIBER : 0) |
+	(is_mux(fd) ? HANDOFF_MUX : 0) |
+	(reply_to == fd ? HANDOFF_REPLY : 0);
+      if (handoff_send(cs,&m,(m.flags & HANDOFF_CLOSED) ? -1 : fd,
+		       &sess[fd].cb,&sess[fd].out) < 0)
+	return -1;
+    }
+  }
+
+  memset (&m, 0, sizeof(m));
+  m.type = HANDOFF_DONE;
+  if (handoff_send(cs,&m,-1,NULL,NULL) < 0)
+    return -1;
+
+  // the new process answers as soon as it has everything, or the
+  // socket times out
+  if (recv(cs,&ack,1,0) != 1) {
+    syslog (LOG_ERR, "new process did not confirm handoff");
+    return -1;
+  }
+  return 0;
+}
+
+// take over the tty, listener and sessions of the process on hs
+int takeover(int hs)
+{
+  struct handoff_msg m;
+  int fd;
+
+  while (1) {
+    if (handoff_recv(hs,&m,&fd) < 0)
+      return -1;
+
+    if (m.type == HANDOFF_DONE)
+      break;
+
+    if (m.type == HANDOFF_LISTENER) {
+      if (add_listener(fd,m.flags) < 0)
+	return -1;
+      if (fd >= maxfd)
+	maxfd = fd + 1;
+      continue;
+    }
+
+    if (m.type == HANDOFF_SESSION && fd < 0) {
+      // closed, keep an fd number for its remaining records
+      fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	return -1;
+      FD_SET (fd, &closed);
+    } else if (fd < 0) {
+      syslog (LOG_ERR, "handoff message %d carried no descriptor",m.type);
+      return -1;
+    }
+
+    if (fd >= FD_SETSIZE) {
+      syslog (LOG_ERR, "no room for handed over fd %d",fd);
+      return -1;
+    }
+
+    int init = m.type == HANDOFF_TTY ? tty_policy.init : session_policy.init;
+    if (m.flags & HANDOFF_SUBSCRIBER) {
+      memset (&sess[fd], 0, sizeof(sess[fd]));
+      FD_SET (fd, &subscribers);
+    } else if (new_cbuff(&sess[fd].cb,m.len > init ? m.len : init) < 0 ||
+	       handoff_recv_cbuff(hs,&sess[fd].cb,m.len) < 0) {
+      return -1;
+    }
+    // tty records the session hasn't taken yet, written as it can
+    if (m.outlen && (new_cbuff(&sess[fd].out,m.outlen) < 0 ||
+		     handoff_recv_cbuff(hs,&sess[fd].out,m.outlen) < 0))
+      return -1;
+
+    sess[fd].fr = m.fr;
+
+    if (m.type == HANDOFF_TTY) {
+      tty = fd;
+      save = m.save;
+      serial_saved = m.serial_saved;
+      serial_save = m.serial_save;
+      sess[fd].fr.fr = &tty_framing;
+      continue;
+    }
+
+    sess[fd].fr.fr = m.flags & HANDOFF_MUX ? &mux_framing : &session_framing;
+    sess[fd].mux = m.mux;
+    sess[fd].holder = FD_ISSET (fd, &closed);
+    sess[fd].listener = find_mode(m.flags & HANDOFF_SUBSCRIBER ? LISTEN_SUBSCRIBE :
+				  m.flags & HANDOFF_MUX ? LISTEN_MUX : LISTEN_DATA);
+    sess[fd].active = now_ms();
+    start_session(fd);
+    if (m.outlen && stall_timeout)
+      timer_add(&timers,&sess[fd].stall,sess[fd].active + stall_timeout);
+    sess[fd].addrlen = sizeof(sess[fd].addr);
+    if (getpeername(fd,(struct sockaddr *) &sess[fd].addr,&sess[fd].addrlen) == -1)
+      sess[fd].addrlen = 0;
+    FD_SET (fd, &sessions);
+    nsessions++;
+    if (fd >= maxfd)
+      maxfd = fd + 1;
+    if (m.flags & HANDOFF_PENDING)
+      pending = fd;
+    if (m.flags & HANDOFF_LAST)
+      last = fd;
+    if (m.flags & HANDOFF_REPLY)
+      reply_to = fd;
+  }
+
+  if (tty < 0) {
+    syslog (LOG_ERR, "handoff did not include the tty");
+    return -1;
+  }
+
+  if (configure_terminal(tty,baudstr,TCSANOW) < 0)
+    return -1;
+
+  if (write(hs,"",1) != 1) {
+    syslog (LOG_ERR, "%m: confirming handoff failed");
+    return -1;
+  }
+
+  syslog (LOG_INFO, "took over tty fd %d, %d listeners and %d sessions",tty,nlisteners,nsessions);
+  return 0;
+}
+
+// stop reading from a session.  a subscriber has nothing more to do
+// and is released, other sessions keep their complete records until
+// they have been written.  until then the connection is shut down but
+// the fd stays open, so its number can't be handed to a new session.
+void close_session(int fd)
+{
+  if (FD_ISSET (fd, &closed))
+    return;
+  trace (TR_CLOSE,fd,sess[fd].cb.len - sess[fd].cb.left);
+  if (FD_ISSET (fd, &subscribers)) {
+    close(fd);
+    release_session(fd);
+    return;
+  }
+  shutdown(fd,SHUT_RDWR);
+  sess[fd].holder = 1;
+  FD_SET (fd, &closed);
+  timer_cancel(&timers,&sess[fd].idle);
+  timer_cancel(&timers,&sess[fd].flush);
+  timer_cancel(&timers,&sess[fd].stall);
+  free_cbuff(&sess[fd].out);
+}
+
+void release_session(int fd)
+{
+  trace (TR_RELEASE,fd,0);
+  timer_cancel(&timers,&sess[fd].idle);
+  timer_cancel(&timers,&sess[fd].flush);
+  timer_cancel(&timers,&sess[fd].stall);
+  free_cbuff(&sess[fd].cb);
+  free_cbuff(&sess[fd].out);
+  mux_free(&sess[fd].mux);
+  if (reply_to == fd)
+    reply_to = -1;
+  if (pending == fd)
+    pending = 0;
+  if (last == fd)
+    last = 0;
+  if (sess[fd].holder) {
+    close(fd);
+    sess[fd].holder = 0;
+  }
+  FD_CLR(fd,&sessions);
+  FD_CLR(fd,&closed);
+  FD_CLR(fd,&subscribers);
+  nsessions--;
+}
+
+static void idle_expired(struct timer *t)
+{
+  int fd = t->data;
+  long long idle = timers.clk - sess[fd].active;
+
+  // activity doesn't touch the timer, it is checked here instead
+  if (idle < idle_timeout * 1000LL) {
+    timer_add(&timers,t,sess[fd].active + idle_timeout * 1000LL);
+    return;
+  }
+  trace (TR_TIMER,fd,TR_TIMER_IDLE);
+  if (verbose)
+    syslog (LOG_INFO, "connection %d from %s idle, closing",fd,session_name(fd));
+  close_session(fd);
+}
+
+static void flush_expired(struct timer *t)
+{
+  int fd = t->data;
+  framer_flush(&sess[fd].fr,&sess[fd].cb);
+  trace (TR_TIMER,fd,TR_TIMER_FLUSH);
+}
+
+static void stall_expired(struct timer *t)
+{
+  int fd = t->data;
+  trace (TR_TIMER,fd,TR_TIMER_STALL);
+  syslog (LOG_INFO, "connection %d from %s stopped reading, closing",fd,session_name(fd));
+  evictions++;
+  close_session(fd);
+}
+
+static void stats_expired(struct timer *t)
+{
+  syslog (LOG_INFO, "%d sessions ; %llu bytes, %llu records to tty ; %llu bytes from tty ; %llu evicted",
+	  nsessions,bytes_to_tty,records_to_tty,bytes_from_tty,evictions);
+  timer_add(&timers,t,t->expires + stats_interval * 1000LL);
+}
+
+static void shrink_expired(struct timer *t)
+{
+  shrink_idle_buffers(timers.clk);
+  timer_add(&timers,t,t->expires + shrink_idle * 1000LL);
+}
+
+// arm the timers of a new session
+void start_session(int fd)
+{
+  bucket_init(&sess[fd].bucket,&session_rate,sess[fd].active);
+  timer_init(&sess[fd].idle,idle_expired,fd);
+  timer_init(&sess[fd].flush,flush_expired,fd);
+  timer_init(&sess[fd].stall,stall_expired,fd);
+  if (idle_timeout && !FD_ISSET (fd, &subscribers) && !FD_ISSET (fd, &closed))
+    timer_add(&timers,&sess[fd].idle,sess[fd].active + idle_timeout * 1000LL);
+}
+
+// count what a session sent against its own limit and its listener's
+void charge(int fd, long long now, int bytes, int records)
+{
+  bucket_take(&sess[fd].bucket,&session_rate,now,bytes,records);
+  bucket_take(&listeners[sess[fd].listener].bucket,&listener_rate,now,bytes,records);
+}
+
+// a session over either limit isn't read from until it is back under,
+// which leaves its data in the socket so TCP pushes back on the sender.
+// returns the ms until then, 0 if it may be read now.
+long throttled(int fd, long long now)
+{
+  long wait = bucket_wait(&sess[fd].bucket,&session_rate,now);
+  long lwait = bucket_wait(&listeners[sess[fd].listener].bucket,&listener_rate,now);
+  return wait > lwait ? wait : lwait;
+}
+
+// records already read are held back from the tty while either limit
+// on records is in debt.  returns the ms until then, 0 if the session
+// may have another record written now.
+long records_throttled(int fd, long long now)
+{
+  if (!session_rate.records && !listener_rate.records)
+    return 0;
+  long wait = bucket_records_wait(&sess[fd].bucket,&session_rate,now);
+  long lwait = bucket_records_wait(&listeners[sess[fd].listener].bucket,&listener_rate,now);
+  return wait > lwait ? wait : lwait;
+}
+
+// keep the part of a tty record that a slow reader didn't take, after
+// the first done bytes of iov, to write when it can take more.  a reader
+// more than BACKLOG_MAX behind has lost its stream and -1 is returned.
+// in real-time mode, where the loop doesn't allocate, the backlog is
+// one of the preallocated buffers and the limit is its size.
+int queue_backlog(int fd, struct iovec *iov, int iovcnt, int done)
+{
+  struct cbuff *out = &sess[fd].out;
+  int used = out->len - out->left;
+  int limit = BACKLOG_MAX;
+  int n = -done;
+
+  for (int i=0 ; i<iovcnt ; i++)
+    n += iov[i].iov_len;
+  if (realtime)
+    limit = out->len > rt_backlog ? out->len : rt_backlog;
+  if (used + n > limit)
+    return -1;
+  if (n > out->left) {
+    int size = out->len ? out->len : CBUFFSIZE;
+    while (size - used < n)
+      size *= 2;
+    if (realtime)
+      size = limit;
+    if ((out->len ? resize_cbuff(out,size) : new_cbuff(out,size)) < 0)
+      return -1;
+  }
+  for (int i=0 ; i<iovcnt ; i++) {
+    int skip = done < (int) iov[i].iov_len ? done : (int) iov[i].iov_len;
+    done -= skip;
+    if (iov[i].iov_len > (size_t) skip)
+      buf2cbuf(out,(char *) iov[i].iov_base + skip,iov[i].iov_len - skip);
+  }
+  return 0;
+}
+
+// write a tty record to a session.  records queue up behind any it
+// hasn't taken yet so that it gets each one whole and in order.
+void send_record(int fd, struct iovec *iov, int iovcnt)
+{
+  int n = 0, len = 0;
+
+  for (int i=0 ; i<iovcnt ; i++)
+    n += iov[i].iov_len;
+  if (sess[fd].out.len == sess[fd].out.left) {
+    len = writev(fd,iov,iovcnt);
+    if (len < 0)
+      len = 0;
+  }
+  if (len == n) {
+    trace (TR_WRITE,fd,len);
+    return;
+  }
+  trace (TR_PARTIAL,fd,len);
+  if (queue_backlog(fd,iov,iovcnt,len) < 0) {
+    syslog (LOG_ERR, "session %d is too far behind (%d bytes), closing",
+	    fd,sess[fd].out.len - sess[fd].out.left + n - len);
+    evictions++;
+    close_session(fd);
+    return;
+  }
+  // give a slow reader a while to catch up before dropping it
+  if (stall_timeout && !timer_pending(&sess[fd].stall))
+    timer_add(&timers,&sess[fd].stall,now_ms() + stall_timeout);
+}
+
+// write what a slow reader is owed as it becomes able to take it
+void flush_backlog(int fd)
+{
+  struct cbuff *out = &sess[fd].out;
+  int len = cbuf2write(out,fd,out->len - out->left);
+  trace (TR_WRITE,fd,len);
+  if (len <= 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    if (verbose)
+      syslog (LOG_INFO, "%m writing to connection %d from %s, closing",fd,session_name(fd));
+    close_session(fd);
+  } else if (out->left == out->len) {
+    free_cbuff(out);
+    timer_cancel(&timers,&sess[fd].stall);
+  }
+}
+
+// give a multiplexed session its turn at the tty: as many records from
+// the channel first in line as its weight, stopping early at a record
+// from another channel, and acting on control frames along the way.
+// headers are dropped in the ring and only payloads are written.
+// returns the number of records started.
+int mux_to_tty(int fd, long *pace_usec)
+{
+  int credit = 1, started = 0, channel = -1;
+
+  while (!pending) {
+    int n = framer_next(&sess[fd].fr,&sess[fd].cb);
+    if (n <= 0)
+      break;
+
+    struct mux_hdr h;
+    unsigned char arg;
+    mux_peek(&sess[fd].cb,&h,&arg);
+    if (h.type != MUX_DATA) {
+      mux_control(&sess[fd].mux,&h,arg);
+      cbuf_discard(&sess[fd].cb,n);
+      framer_consume(&sess[fd].fr,n);
+      continue;
+    }
+
+    if (!started) {
+      channel = h.channel;
+      credit = mux_weight(&sess[fd].mux,channel);
+    } else if (h.channel != channel || started == credit || !tty_paced(tty,pace_usec) ||
+	       records_throttled(fd,now_ms())) {
+      // another channel's record waits for the session's next turn
+      break;
+    }
+
+    trace (TR_RECORD,fd,n);
+    cbuf_note_record(&sess[fd].sz,n);
+    cbuf_note_record(&listeners[sess[fd].listener].sz,n);
+    cbuf_discard(&sess[fd].cb,MUX_HDRLEN);
+    framer_consume(&sess[fd].fr,MUX_HDRLEN);
+    started++;
+
+    charge(fd,now_ms(),0,1);
+
+    // whatever the tty says next is taken to be the answer
+    sess[fd].mux.reply = h.channel;
+    reply_to = fd;
+
+    if (!h.len)
+      continue;
+    int len = cbuf2write(&sess[fd].cb,tty,h.len);
+    trace (TR_TTY_WRITE,fd,len);
+    if (len > 0) {
+      framer_consume(&sess[fd].fr,len);
+      bytes_to_tty += len;
+    }
+    if (len == (int) h.len) {
+      records_to_tty++;
+    } else {
+      // the header is gone, so the rest has to be finished from here
+      pending = fd;
+    }
+  }
+  return started;
+}
+
+// grow a session's buffer that filled up without a complete record,
+// to what its listener's records mostly need or what its own do if that
+// is more.  a record that won't fit within the listener's limit closes
+// the session.
+int grow_session(int fd)
+{
+  struct listener *l = &listeners[sess[fd].listener];
+  struct cbuff_sizing *sz = cbuf_suggest(&sess[fd].sz,SIZING_PERCENT) >
+    cbuf_suggest(&l->sz,SIZING_PERCENT) ? &sess[fd].sz : &l->sz;
+  int n = cbuf_grow_size(&sess[fd].cb,&l->policy,sz);
+  if (n < 0) {
+    syslog (LOG_ERR, "record from session %d exceeds %d bytes, closing",fd,l->policy.max);
+    close_session(fd);
+    cbuf_discard(&sess[fd].cb,sess[fd].cb.len);
+    framer_init(&sess[fd].fr,sess[fd].fr.fr);
+    return -1;
+  }
+  if (resize_cbuff(&sess[fd].cb,n) < 0) {
+    syslog (LOG_DEBUG, "resize_cbuff session %d failed",fd);
+    return -1;
+  }
+  trace (TR_RESIZE,fd,n);
+  return 0;
+}
+
+// give back memory held by buffers that haven't seen data for a while
+void shrink_idle_buffers(long long now)
+{
+  for (int fd=0 ; fd<FD_SETSIZE ; fd++) {
+    if (fd == tty ? 
+	now - sess[fd].active >= shrink_idle * 1000LL :
+	FD_ISSET (fd, &sessions) && !FD_ISSET (fd, &subscribers) &&
+	!FD_ISSET (fd, &closed) && fd != pending &&
+	now - sess[fd].active >= shrink_idle * 1000LL)
+      cbuf_shrink(&sess[fd].cb,
+		  fd == tty ? &tty_policy : &listeners[sess[fd].listener].policy);
+  }
+}
+
 int main(int argc,char** argv)
 {
   int c;
@@ -185,13 +1082,33 @@ int main(int argc,char** argv)
     { 0, 0, 0, 0, "Informational options:", -1 },
     { "verbose", 'v', 0, 0, "Be more verbose" },
     { "quiet", 'q', 0, 0, "Be quiet" },
+    { "trace-file", 'x', "<path>", 0, "Where to dump the event trace on SIGUSR1 or a crash" },
     { 0, 0, 0, 0, "Connection parameters:", 7},
     { "baud", 'b', "<baud>", 0, "Baud for tty" },
     { "flowctrl", 'f', 0, 0, "Enable hardware flow control" },
-    { "port", 'p', "<port>", 0, "Port number to listen on" },
+    { "pace", 'P', "ms", OPTION_ARG_OPTIONAL, "Limit tty output queue to one record [or ms at baud]" },
+    { "tty-profile", 'R', "<profile>", 0, "tty reads: default, throughput[:<vmin>] or latency" },
+    { "realtime", 'r', "<cpu>[:<prio>]", OPTION_ARG_OPTIONAL, "Pin to cpu, run SCHED_FIFO and preallocate everything" },
+    { "port", 'p', "<port>[,<buffer>]", 0, "Port number to listen on, and buffer sizes for its connections" },
+    { "subscribe-port", 's', "<port>", 0, "Port number for receive-only connections" },
+    { "mux-port", 'M', "<port>[,<buffer>]", 0, "Port number for multiplexed connections, and their buffer sizes" },
+    { "max-sessions", 'm', "<n>", 0, "Refuse connections beyond n sessions" },
+    { "handoff", 'H', "<path>", 0, "Take over from, and hand over to, another mux2tty at path" },
     { 0, 0, 0, 0, "Buffering options:", 8 },
     { "line-buffering", 'l', 0, 0, "Line buffering" },
     { "tiu-buffering", 't', 0, 0, "TIU buffering" },
+    { "framing", 'F', "<framing>", 0, "Framing of records from connections" },
+    { "tty-framing", 'T', "<framing>", 0, "Framing of records from the tty" },
+    { "session-buffer", 'B', "<init>[:<min>:<max>]", 0, "Connection buffer sizes" },
+    { "tty-buffer", 'Y', "<init>[:<min>:<max>]", 0, "tty buffer sizes" },
+    { "shrink-idle", 'I', "<secs>", 0, "Shrink buffers idle for secs" },
+    { "session-rate", 'L', "<bytes/s>[:<records/s>]", 0, "Stop reading from a connection over this rate" },
+    { "listener-rate", 'G', "<bytes/s>[:<records/s>]", 0, "Stop reading from a port's connections over this rate" },
+    { 0, 0, 0, 0, "Timeouts:", 9 },
+    { "idle-timeout", 'i', "<secs>", 0, "Close connections that send nothing for secs" },
+    { "flush-timeout", 'u', "<ms>", 0, "Forward records left unfinished for ms" },
+    { "stall-timeout", 'w', "<ms>", 0, "Close connections that stop reading for ms" },
+    { "stats-interval", 'S', "<secs>", 0, "Log statistics every secs" },
     { 0 }
   };
 
@@ -237,7 +1154,29 @@ int main(int argc,char** argv)
     openlog ("mux2tty", LOG_PID | LOG_PERROR, LOG_DAEMON);
   }
 
-  tty = validate_terminal (ttystr, baudstr);
+  // what happens on every pass of the loop goes to the trace ring,
+  // debug messages are left for rarer events
+  if (!debug)
+    setlogmask (LOG_UPTO (LOG_INFO));
+
+  FD_ZERO(&sessions);
+  FD_ZERO(&closed);
+  FD_ZERO(&subscribers);
+  timer_wheel_init(&timers,now_ms());
+
+  int hs = handoffstr ? handoff_connect (handoffstr) : -1;
+
+  if (hs >= 0) {
+    // another mux2tty is running, carry on where it leaves off
+    tty = -1;
+    if (takeover (hs) < 0) {
+      syslog (LOG_ERR, "taking over from %s failed", handoffstr);
+      return -2;
+    }
+    close (hs);
+  } else {
+    tty = validate_terminal (ttystr, baudstr);
+  }
 
   if (tty < 0) {
     syslog (LOG_ERR, "opening terminal %s at %s failed with error %d", ttystr, baudstr, tty);
@@ -253,7 +1192,7 @@ int main(int argc,char** argv)
 
     pidfn = strndup(buf,64);
 
-    int fd = open (buf, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    int fd = open (buf, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
       syslog (LOG_ERR, "%m can't open pid file: %s", buf);
       return -3;
@@ -279,113 +1218,264 @@ int main(int argc,char** argv)
     close(fd);
   }
 
-  int port = validate_port(portstr);
+  // a session that goes away is noticed when it is read from, not by
+  // being killed writing to it
+  signal(SIGPIPE,SIG_IGN);
+
+  char tracefn[64];
+  if (!tracestr) {
+    snprintf(tracefn,64,"/var/run/mux2tty.%s.trace",basename(ttystr));
+    tracestr = tracefn;
+  }
+  trace_init(tracestr);
+
+  if (open_listener(portstr,LISTEN_DATA) < 0)
+    return -6;
+
+  if (subportstr && open_listener(subportstr,LISTEN_SUBSCRIBE) < 0)
+    return -6;
 
-  if (port < 0) {
+  if (muxportstr && open_listener(muxportstr,LISTEN_MUX) < 0)
     return -6;
+
+  if (handoffstr) {
+    handoff_fd = handoff_listen (handoffstr);
+    if (handoff_fd < 0)
+      return -6;
   }
 
   if (verbose) {
     syslog (LOG_INFO, "terminal = %s ; tty fd = %d ; baud = %s", ttystr, tty, baudstr);
-    syslog (LOG_INFO, "port = %s ; port number = %d",portstr,port);
   }
 
-  struct cbuff* b = NULL;
-
   int len = 0;
   int nfds = 0;
 
-  b = (struct cbuff*) calloc (tty + 1, sizeof(struct cbuff));
-  if (!b) {
-    syslog (LOG_ERR, "failed to allocated cbuff array for tty");
+  if (tty >= FD_SETSIZE) {
+    syslog (LOG_ERR, "tty fd %d is past FD_SETSIZE",tty);
     return -7;
   }
 
-  if (new_cbuff(b+tty,CBUFFSIZE) < 0) {
-    syslog (LOG_ERR, "failed to allocated cbuff buffer for tty");
-    return -8;
+  // a throughput batch has to fit in one read, so the tty buffer is
+  // never smaller than a few of them, not even when shrunk
+  if (tty_profile == TTY_THROUGHPUT && tty_policy.min < 4 * tty_vmin) {
+    tty_policy.min = 4 * tty_vmin;
+    if (tty_policy.init < tty_policy.min)
+      tty_policy.init = tty_policy.min;
+    if (tty_policy.max && tty_policy.max < tty_policy.min)
+      tty_policy.max = tty_policy.min;
+  }
+  int ttysize = tty_policy.init;
+  if (hs >= 0) {
+    if (sess[tty].cb.len < ttysize && resize_cbuff(&sess[tty].cb,ttysize) < 0) {
+      syslog (LOG_ERR, "failed to resize cbuff buffer for tty");
+      return -8;
+    }
+  } else {
+    if (new_cbuff(&sess[tty].cb,ttysize) < 0) {
+      syslog (LOG_ERR, "failed to allocated cbuff buffer for tty");
+      return -8;
+    }
+    framer_init(&sess[tty].fr,&tty_framing);
+  }
+  timer_init(&sess[tty].flush,flush_expired,tty);
+
+  if (realtime) {
+    // a buffer for every session is allocated up front at the largest
+    // size a session's buffer may reach on any listener, so the loop
+    // never grows, shrinks or allocates one
+    int size = 0;
+    for (int i=0 ; i<nlisteners ; i++) {
+      if (listeners[i].mode == LISTEN_SUBSCRIBE)
+	continue;
+      if (!listeners[i].policy.max) {
+	syslog (LOG_ERR, "real-time mode needs a max buffer size for every port");
+	return -9;
+      }
+      if (listeners[i].policy.max > size)
+	size = listeners[i].policy.max;
+    }
+    if (shrink_idle) {
+      syslog (LOG_INFO, "buffers are not shrunk in real-time mode");
+      shrink_idle = 0;
+    }
+    if (cbuf_reserve(max_sessions,size) < 0) {
+      syslog (LOG_ERR, "failed to preallocate %d buffers of %d bytes",max_sessions,size);
+      return -9;
+    }
+    rt_bufsize = size;
+    // the tty buffer is allocated at its largest too, its initial size
+    // if it has no max
+    if (!tty_policy.max || tty_policy.max < sess[tty].cb.len)
+      tty_policy.max = sess[tty].cb.len;
+    if (sess[tty].cb.len < tty_policy.max && resize_cbuff(&sess[tty].cb,tty_policy.max) < 0) {
+      syslog (LOG_ERR, "failed to preallocate tty buffer of %d bytes",tty_policy.max);
+      return -9;
+    }
+    // and a backlog for every session, for a reader that falls a few
+    // tty buffers behind before it is dropped
+    rt_backlog = RT_BACKLOG * (tty_policy.max + MUX_HDRLEN);
+    if (cbuf_reserve(max_sessions,rt_backlog) < 0) {
+      syslog (LOG_ERR, "failed to preallocate %d backlogs of %d bytes",max_sessions,rt_backlog);
+      return -9;
+    }
+    if (realtime_enter(&rt) < 0)
+      return -9;
   }
 
-  int maxfd = port + 1;
-  fd_set sessions;
-  fd_set closed;
-  FD_ZERO(&sessions);
-  FD_ZERO(&closed);
+  if (shrink_idle) {
+    timer_init(&shrink_timer,shrink_expired,0);
+    timer_add(&timers,&shrink_timer,now_ms() + shrink_idle * 1000LL);
+  }
+  if (stats_interval) {
+    timer_init(&stats_timer,stats_expired,0);
+    timer_add(&timers,&stats_timer,now_ms() + stats_interval * 1000LL);
+  }
 
-  int last = 0;
-  int pending = 0;
+  for (int i=0 ; i<nlisteners ; i++)
+    if (listeners[i].fd >= maxfd)
+      maxfd = listeners[i].fd + 1;
+  if (handoff_fd >= maxfd)
+    maxfd = handoff_fd + 1;
 
   while (1) {
 
     if (verbose) {
-      syslog (LOG_INFO, "tty: %d ; listening %d",tty,port);
+      syslog (LOG_INFO, "tty: %d ; %d listeners",tty,nlisteners);
     }
     fd_set readfds,writefds;
     memcpy(&readfds,&sessions,sizeof(fd_set));
     FD_ZERO(&writefds); // clear output
     FD_SET(tty,&readfds); // tty
-    FD_SET(port,&readfds); // listening for connections
+    for (int i=0 ; i<nlisteners ; i++)
+      FD_SET(listeners[i].fd,&readfds); // listening for connections
+    if (handoff_fd >= 0)
+      FD_SET(handoff_fd,&readfds); // replacement process
+
+    long pace_usec = 0;
+    int paced = tty_paced(tty,&pace_usec);
+    long long top = now_ms();
+    long throttle_ms = -1;
 
-    if (pending) {
-      syslog (LOG_DEBUG, "writes to tty pending");
+    if (pending && paced)
       FD_SET(tty,&writefds);
-    }
+    for (int fd=0 ; fd<nfds ; fd++)
+      if (FD_ISSET (fd, &sessions) && sess[fd].out.len != sess[fd].out.left)
+	FD_SET (fd, &writefds);
 
     for (int fd=0 ; fd<nfds ; fd++) {
-      if (FD_ISSET(fd, &sessions)) {
-	syslog (LOG_DEBUG, "session %d",fd);
-	int n = (buffering == LINE_BUFFERING) ?
-	  cbuf_find(b+fd,delim) :
-	  cbuf_findtiu(b+fd);
+      if (FD_ISSET(fd, &sessions) && !FD_ISSET(fd, &subscribers)) {
+	int n = framer_next(&sess[fd].fr,&sess[fd].cb);
+	if (n < 0) {
+	  // stream can't be framed, drop what it sent and close it
+	  syslog (LOG_ERR, "framing error on session %d, closing",fd);
+	  close_session(fd);
+	  n = 0;
+	}
 	if (FD_ISSET (fd, &closed)) {
-	  syslog (LOG_DEBUG, "session %d is closed, don't read",fd);
 	  // session is closed, so don't read
 	  FD_CLR(fd,&readfds);
 	  if (!n) {
 	    // closed session has no more complete records
 	    // and won't be getting any new ones, so release
 	    // and remove from future consideration
-	    syslog (LOG_DEBUG, "no complete records in closed session %d",fd);
-	    free_cbuff(b+fd);
-	    FD_CLR(fd,&sessions);
-	    FD_CLR(fd,&closed);
-	    syslog (LOG_DEBUG, "freeing cbuff and removing %d from sessions and closed lists",fd);
+	    release_session(fd);
+	  }
+	}
+	if (!FD_ISSET (fd, &closed) && (session_rate.bytes || session_rate.records ||
+					 listener_rate.bytes || listener_rate.records)) {
+	  long wait = throttled(fd,top);
+	  if (wait) {
+	    trace (TR_THROTTLE,fd,wait);
+	    FD_CLR(fd,&readfds);
+	    if (throttle_ms < 0 || wait < throttle_ms)
+	      throttle_ms = wait;
 	  }
 	}
 	if (n) {
-	  syslog (LOG_DEBUG, "session %d has %d bytes to write, checking tty for writability",fd,n);
-	  FD_SET(tty,&writefds);
-	} else if (b[fd].left == 0) {
-	  syslog (LOG_DEBUG, "cbuff for session %d does not have a complete record, and is out of space",fd);
-	  // no delimiter, buffer full, so double size
-	  if (resize_cbuff(b+fd,b[fd].len ? b[fd].len * 2 : CBUFFSIZE) < 0)
-	    syslog (LOG_DEBUG, "resize_cbuff session %d failed",fd);
+	  timer_cancel(&timers,&sess[fd].flush);
+	  long wait = fd == pending ? 0 : records_throttled(fd,top);
+	  if (wait) {
+	    // come back for it once the debt is paid
+	    if (throttle_ms < 0 || wait < throttle_ms)
+	      throttle_ms = wait;
+	  } else if (paced) {
+	    FD_SET(tty,&writefds);
+	  }
+	  // a full buffer holding records waits for the tty to drain it
+	  if (!sess[fd].cb.left)
+	    FD_CLR(fd,&readfds);
+	} else if (sess[fd].cb.left == 0 && !FD_ISSET (fd, &closed)) {
+	  trace (TR_FULL,fd,sess[fd].cb.len);
+	  grow_session(fd);
 	}
       }
     }
 
     nfds = max_fds2(&readfds,&sessions,maxfd);
 
-    b = (struct cbuff *) realloc (b,nfds * sizeof(struct cbuff));
+    struct timeval tv, *tvp = NULL;
+    long usec = -1;
+    int queued = 0;
+    if (tty_profile == TTY_THROUGHPUT) {
+      // fewer than VMIN bytes don't wake select, so come back for them
+      // while the tty is busy.  once a batch window has passed with
+      // nothing read or queued the tty is idle, and the first byte to
+      // arrive wakes select instead.
+      if (ioctl(tty,TIOCINQ,&queued) == -1)
+	queued = 0;
+      tty_set_idle(!queued && !tty_busy);
+      if (!tty_idle)
+	usec = tty_batch_usec();
+      tty_busy = 0;
+    }
+    if (!paced && (usec < 0 || pace_usec < usec))
+      usec = pace_usec;
+    if (throttle_ms >= 0 && (usec < 0 || throttle_ms * 1000 < usec))
+      usec = throttle_ms * 1000;
+    long long next = timer_next(&timers);
+    if (next >= 0) {
+      long long wait = timers.clk + next - now_ms();
+      if (wait < 0)
+	wait = 0;
+      if (usec < 0 || wait * 1000 < usec)
+	usec = wait * 1000;
+    }
+    if (usec >= 0) {
+      tv.tv_sec = usec / 1000000;
+      tv.tv_usec = usec % 1000000;
+      tvp = &tv;
+    }
+
+    int ready = select(nfds,&readfds,&writefds,NULL,tvp);
+    long long now = now_ms();
+    trace (TR_WAKE,-1,ready);
 
-    int ready = select(nfds,&readfds,&writefds,NULL,NULL);
+    timer_run(&timers,now);
 
-    if (verbose) 
-      syslog (LOG_DEBUG, "%d fd ready",ready);
+    if (ready == 0 && queued > 0) {
+      // batch window expired, pick up whatever the tty has
+      FD_SET(tty,&readfds);
+      ready = 1;
+    }
 
-    if (ready <= 0) {
-      syslog (LOG_DEBUG, "nothing readable yet, select returned %d",ready);
-    } else {
+    if (ready > 0) {
       for (int fd = 0 ; fd < nfds ; fd++) {
 	if (FD_ISSET (fd, &readfds)) {    
-	  if (verbose) {
-	    syslog (LOG_DEBUG, "read fd = %d",fd);
-	  }
 	  if (fd == tty) {
 	    // data has arrived on tty, read into buffer
-	    len = read2cbuf(b+tty,tty);
-	    if (verbose) {
-	      syslog (LOG_DEBUG, "read %d bytes from tty",len);
+	    if (tty_profile == TTY_LATENCY)
+	      len = read_tty_all();
+	    else
+	      len = read2cbuf(&sess[tty].cb,tty);
+	    trace (TR_READ,tty,len);
+	    if (len > 0) {
+	      sess[tty].active = now;
+	      tty_busy = 1;
+	      if (flush_timeout && framer_can_flush(&sess[tty].fr) &&
+		  !timer_pending(&sess[tty].flush) &&
+		  !framer_next(&sess[tty].fr,&sess[tty].cb))
+		timer_add(&timers,&sess[tty].flush,now + flush_timeout);
 	    }
 	    if (len < 0) {
 	      // error reading tty
@@ -399,140 +1489,254 @@ int main(int argc,char** argv)
 		  FD_SET (i, &closed);
 		}
 	      }
-	      close(port);
+	      for (int i=0 ; i<nlisteners ; i++)
+		close(listeners[i].fd);
 	      if (verbose)
 		syslog (LOG_DEBUG, "tty closed, exiting");
 	      return 0;
 	    } 
-	  } else if (fd == port) {
-	    // connection request on listening port
-	    struct sockaddr_storage naddr;
-	    int addrlen = sizeof(naddr);
-	    char hostname[NI_MAXHOST];
-	    char service[NI_MAXSERV];
-
+	  } else if (find_listener(fd) >= 0) {
+	    // connection requests on listening port.  drain the backlog
+	    // up to a budget so a reconnect storm doesn't starve the tty.
+	    int li = find_listener(fd);
 	    if (verbose) {
-	      syslog (LOG_INFO, "accepting connection on port %d",port);
+	      syslog (LOG_INFO, "accepting connections on port %d",fd);
 	    }
 
-	    int nfd = accept (port, (struct sockaddr *) &naddr, &addrlen);
+	    for (int i=0 ; i<ACCEPT_BUDGET ; i++) {
+	      struct sockaddr_storage naddr;
+	      socklen_t addrlen = sizeof(naddr);
 
-	    if (nfd < 0) {
-	      syslog (LOG_ERR, "error %d accepting connection on port %d",nfd,port);
-	    } else {
-	      FD_SET (nfd, &sessions);
-	      if (nfd >= maxfd) 
-		maxfd = nfd + 1;
+	      int nfd = accept4 (fd, (struct sockaddr *) &naddr, &addrlen,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-	      nfds = max_fds(&sessions,maxfd);
+	      if (nfd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		  syslog (LOG_ERR, "%m accepting connection on port %d",fd);
+		break;
+	      }
 
-	      b = (struct cbuff *) realloc (b, nfds * sizeof(struct cbuff));
-	      if (!b) {
-		syslog (LOG_ERR, "failure to allocate cbuff array for %d",nfd);
-		return -5;
+	      if (nfd >= FD_SETSIZE || 
+		  (max_sessions && nsessions >= max_sessions)) {
+		// fast reject, nothing has been allocated for it yet
+		trace (TR_REJECT,nfd,nsessions);
+		close(nfd);
+		continue;
 	      }
 
-	      if (new_cbuff(b+nfd,CBUFFSIZE) < 0) {
+	      memset (&sess[nfd], 0, sizeof(sess[nfd]));
+
+	      // start at the size most of this listener's records need.
+	      // without a max that is kept to a few times init, or a few
+	      // clients sending huge records would have every connection
+	      // that follows allocate as much; buffers still grow to fit.
+	      struct cbuff_policy *p = &listeners[li].policy;
+	      int limit = p->max ? p->max : PRESIZE_LIMIT * p->init;
+	      int size = cbuf_suggest(&listeners[li].sz,SIZING_PERCENT);
+	      if (size < p->init)
+		size = p->init;
+	      if (size > limit)
+		size = limit;
+	      // anything larger than the preallocated buffers would be malloced
+	      if (rt_bufsize && size > rt_bufsize)
+		size = rt_bufsize;
+
+	      if (listeners[li].mode == LISTEN_SUBSCRIBE) {
+		// nothing will be read, so no inbound buffer
+		FD_SET (nfd, &subscribers);
+	      } else if (new_cbuff(&sess[nfd].cb,size) < 0) {
 		syslog (LOG_ERR, "failed to allocated cbuff buffer for %d",nfd);
-		return -6;
+		close(nfd);
+		continue;
 	      }
 
-	      if (getnameinfo((struct sockaddr *) &naddr,addrlen,
-			      hostname,NI_MAXHOST,
-			      service,NI_MAXSERV,
-			      NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
-		syslog (LOG_ERR, "getnameinfo failed");
-	      } else {
-		syslog (LOG_INFO, "connection %d from %s:%s",nfd,hostname,service);
+	      framer_init(&sess[nfd].fr,listeners[li].mode == LISTEN_MUX ?
+			  &mux_framing : &session_framing);
+	      memcpy (&sess[nfd].addr, &naddr, addrlen);
+	      sess[nfd].addrlen = addrlen;
+	      sess[nfd].listener = li;
+	      sess[nfd].active = now;
+	      start_session(nfd);
+	      trace (TR_ACCEPT,nfd,li);
+
+	      FD_SET (nfd, &sessions);
+	      nsessions++;
+	      if (nfd >= maxfd) 
+		maxfd = nfd + 1;
+
+	      if (verbose)
+		syslog (LOG_INFO, "connection %d from %s",nfd,session_name(nfd));
+	    }
+	    nfds = max_fds(&sessions,maxfd);
+	  } else if (fd == handoff_fd) {
+	    // a new mux2tty wants to take over
+	    int cs = accept4 (handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+	    if (cs >= 0) {
+	      if (handoff_give(cs) == 0) {
+		handed_off = 1;
+		syslog (LOG_INFO, "handed over, exiting");
+		exit(0);
 	      }
+	      syslog (LOG_ERR, "handoff failed, carrying on");
+	      close(cs);
+	    }
+	  } else if (FD_ISSET (fd, &subscribers)) {
+	    // subscribers only receive, discard anything they send and
+	    // watch for them going away
+	    char discard[512];
+	    len = read (fd,discard,sizeof(discard));
+	    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+	      if (verbose)
+		syslog (LOG_INFO, "connection %d from %s closed",fd,session_name(fd));
+	      close_session(fd);
 	    }
 	  } else {
 	    // received data from a session
-	    len = read2cbuf (b+fd,fd);
-	    if (verbose) {
-	      syslog (LOG_DEBUG, "read %d bytes from session %d",len,fd);
+	    len = read2cbuf (&sess[fd].cb,fd);
+	    trace (TR_READ,fd,len);
+	    if (len > 0) {
+	      sess[fd].active = now;
+	      charge(fd,now,len,0);
+	      // neither a length-prefixed nor a multiplexed stream can be
+	      // cut short without losing its framing
+	      if (flush_timeout && framer_can_flush(&sess[fd].fr) &&
+		  !timer_pending(&sess[fd].flush) &&
+		  !framer_next(&sess[fd].fr,&sess[fd].cb))
+		timer_add(&timers,&sess[fd].flush,now + flush_timeout);
 	    }
 	    if (len < 0) {
-	      // error reading session
+	      // error reading session, syslog may change errno
+	      int err = errno;
 	      syslog (LOG_ERR, "error reading fd %d",fd);
+	      if (sess[fd].cb.left && err != EAGAIN && err != EINTR)
+		close_session(fd);
 	    } else if (len == 0) {
 	      // session closed
+	      if (verbose)
+		syslog (LOG_INFO, "connection %d from %s closed",fd,session_name(fd));
 	      syslog (LOG_DEBUG, "closing session %d cbuff contains %d bytes",
-		      fd, b[fd].len - b[fd].left);
-	      close(fd);
-	      syslog (LOG_DEBUG, "marking session %d closed",fd);
-	      FD_SET (fd, &closed);
+		      fd, sess[fd].cb.len - sess[fd].cb.left);
+	      close_session(fd);
 	    } 
 	  }
 	}
       }
+      // catch slow readers up
+      for (int fd=0 ; fd<nfds ; fd++)
+	if (fd != tty && FD_ISSET (fd, &writefds) && FD_ISSET (fd, &sessions) &&
+	    sess[fd].out.len != sess[fd].out.left)
+	  flush_backlog(fd);
       // try to write
       if (FD_ISSET (tty, &writefds)) {
-	syslog (LOG_DEBUG, "tty is writable");
 	if (pending) {
-	  syslog (LOG_DEBUG, "serving pending buffer %d",pending);
-	  int n = (buffering == LINE_BUFFERING) ?
-	    cbuf_find (b+pending,delim) :
-	    cbuf_findtiu(b+pending);
-	  int len = cbuf2write(b+pending,tty,n);
+	  int n = framer_next(&sess[pending].fr,&sess[pending].cb);
+	  int len = cbuf2write(&sess[pending].cb,tty,n);
+	  trace (TR_TTY_WRITE,pending,len);
+	  if (len > 0) {
+	    framer_consume(&sess[pending].fr,len);
+	    bytes_to_tty += len;
+	  }
 	  if (len == n) {
-	    syslog (LOG_DEBUG, "completed pending buffer %d",pending);
+	    records_to_tty++;
 	    pending = 0;
 	  }
 	}
-	syslog (LOG_DEBUG, "pending = %d",pending);
 	if (!pending) {
 	  for (int i=0 ; i<nfds ; i++) {
 	    int fd = (last + i + 1) % nfds;
-	    if (FD_ISSET (fd, &sessions)) {
-	      syslog (LOG_DEBUG, "looking for delimiter in session %d buffer",fd);
-	      int n = (buffering == LINE_BUFFERING) ?
-		cbuf_find (b+fd,delim) :
-		cbuf_findtiu (b+fd);
-	      if (n) {
-		syslog (LOG_DEBUG, "record delimter found at offset %d of buffer %d",n,fd);
-		int len = cbuf2write(b+fd,tty,n);
-		syslog (LOG_DEBUG, "wrote %d bytes to tty from session %d",len,fd);
+	    if (FD_ISSET (fd, &sessions) && !FD_ISSET (fd, &subscribers)) {
+	      int n = framer_next(&sess[fd].fr,&sess[fd].cb);
+	      if (n > 0 && records_throttled(fd,now)) {
+		// over its records limit, its turn is skipped
+		trace (TR_THROTTLE,fd,0);
+	      } else if (n > 0 && is_mux(fd)) {
+		mux_to_tty(fd,&pace_usec);
+		last = fd;
+		if (pending || !tty_paced(tty,&pace_usec))
+		  break;
+	      } else if (n > 0) {
+		trace (TR_RECORD,fd,n);
+		cbuf_note_record(&sess[fd].sz,n);
+		cbuf_note_record(&listeners[sess[fd].listener].sz,n);
+		int len = cbuf2write(&sess[fd].cb,tty,n);
+		trace (TR_TTY_WRITE,fd,len);
+		if (len > 0) {
+		  framer_consume(&sess[fd].fr,len);
+		  bytes_to_tty += len;
+		  reply_to = -1;
+		  charge(fd,now,0,1);
+		}
+		if (len == n)
+		  records_to_tty++;
 		if (len > 0 && len < n) {
 		  pending = fd;
 		} 
 		last = fd;
-		syslog (LOG_DEBUG, "last session %d",last);
-	      } else if (b[fd].left == 0) {
-		// no delimiter, buffer full, so double size
-		syslog (LOG_DEBUG, "resizing buffer for session %d",fd);
-		if (resize_cbuff(b+fd,b[fd].len ? b[fd].len * 2 : CBUFFSIZE) < 0)
-		  syslog (LOG_DEBUG, "resize_cbuff session %d failed",fd);
+		// don't start another record behind a partial one, or
+		// past the pacing limit
+		if (pending || !tty_paced(tty,&pace_usec))
+		  break;
+	      } else if (n == 0 && sess[fd].cb.left == 0 && !FD_ISSET (fd, &closed)) {
+		trace (TR_FULL,fd,sess[fd].cb.len);
+		grow_session(fd);
 	      }
 	    }
 	  }
 	}
       }
-      // check tty cbuff for records, if ready, send to sessions
-      syslog (LOG_DEBUG, "looking for delimiter in tty %d buffer",tty);
-      int n = (buffering == LINE_BUFFERING) ?
-	cbuf_find (b+tty,delim) :
-	cbuf_finduit (b+tty);
-      // hack to avoid waiting for a delimiter from tty
-      n = (b+tty)->len - (b+tty)->left;
-      if (n) {
-	char buf[CBUFFSIZE];
-	int len = cbuf2buf (b+tty,buf,n>CBUFFSIZE ? CBUFFSIZE : n);
-	syslog (LOG_DEBUG, "copied %d of %d chars to buffer",len,n);
-	for (int fd=0 ; fd<nfds ; fd++) {
-	  if (FD_ISSET (fd, &sessions)) {
-	    len = write(fd,buf,n);
-	    if (len < n) {
-	      syslog (LOG_DEBUG, "partial write (%d of %d bytes) to session %d",len,n,fd);
-	    } else {
-	      syslog (LOG_DEBUG, "wrote %d bytes to session %d",len,fd);
-	    }
-	  }
-	}	    
-      } else if (b[tty].left == 0)
-	// no delimiter, buffer full, so double size
-	if (resize_cbuff(b+tty,b[tty].len ? b[tty].len * 2 : CBUFFSIZE) < 0)
-	  syslog (LOG_DEBUG, "resize_cbuff tty failed");
+    }
+    // check tty cbuff for records, if ready, send to sessions.  this
+    // runs on every pass, as a record may have been completed by a
+    // timer rather than by a read.
+    int n = framer_next(&sess[tty].fr,&sess[tty].cb);
+    int partial = 0;
+    if (n == 0 && sess[tty].cb.left == 0) {
+      int size = cbuf_grow_size(&sess[tty].cb,&tty_policy,&sess[tty].sz);
+      if (size < 0) {
+	// record won't fit within the limit, pass on what there is
+	syslog (LOG_ERR, "record from tty exceeds %d bytes, forwarding it in pieces",tty_policy.max);
+	n = sess[tty].cb.len;
+	partial = 1;
+      } else if (resize_cbuff(&sess[tty].cb,size) < 0) {
+	syslog (LOG_DEBUG, "resize_cbuff tty failed");
+      } else {
+	trace (TR_RESIZE,tty,size);
+      }
+    }
+    if (n < 0) {
+      syslog (LOG_ERR, "framing error on tty, discarding %d bytes",
+	      sess[tty].cb.len - sess[tty].cb.left);
+      cbuf_discard(&sess[tty].cb,sess[tty].cb.len - sess[tty].cb.left);
+      framer_init(&sess[tty].fr,&tty_framing);
+    } else if (n) {
+      // write the record straight out of the ring to every session
+      timer_cancel(&timers,&sess[tty].flush);
+      bytes_from_tty += n;
+      trace (TR_BROADCAST,tty,n);
+      if (!partial)
+	cbuf_note_record(&sess[tty].sz,n);
+      // multiplexed sessions get the same record behind a header
+      unsigned char hdr[MUX_HDRLEN];
+      struct iovec iov[3];
+      iov[0].iov_base = hdr;
+      iov[0].iov_len = MUX_HDRLEN;
+      int iovcnt = cbuf_iov (&sess[tty].cb,n,iov + 1);
+      for (int fd=0 ; fd<nfds ; fd++) {
+	if (FD_ISSET (fd, &sessions) && !FD_ISSET (fd, &closed) && is_mux(fd)) {
+	  struct mux_hdr h = { MUX_DATA, 0, MUX_BROADCAST, n };
+	  if (reply_to == fd)
+	    h.channel = sess[fd].mux.reply;
+	  mux_encode(hdr,&h);
+	  send_record(fd,iov,iovcnt + 1);
+	} else if (FD_ISSET (fd, &sessions) && !FD_ISSET (fd, &closed)) {
+	  send_record(fd,iov + 1,iovcnt);
+	}
+      }
+      cbuf_discard(&sess[tty].cb,n);
+      if (partial)
+	framer_skip(&sess[tty].fr,n);
+      else
+	framer_consume(&sess[tty].fr,n);
     }
   }
 
@@ -573,22 +1777,38 @@ int validate_terminal (char* ttystr,char* baudstr)
     return -5;
   }
 
-  if ((tcgetattr(fd, &save) == -1) || // stash away for later restoration
-      (tcgetattr(fd, &tp) == -1)) { 
+  if (tcgetattr(fd, &save) == -1) { // stash away for later restoration
     syslog (LOG_ERR, "failed to read attributes from %s",ttystr);
     close(fd);
     return -6;
   }
 
+  int err = configure_terminal(fd, baudstr, TCSAFLUSH);
+  if (err < 0) {
+    close(fd);
+    return err;
+  }
+
+  return fd;
+}
+
+// put an open tty into raw mode at baudstr.  when says how pending
+// data are treated, a tty taken over from another process keeps them.
+int configure_terminal (int fd, char* baudstr, int when)
+{
+  if (tcgetattr(fd, &tp) == -1) { 
+    syslog (LOG_ERR, "failed to read attributes from %s",ttystr);
+    return -6;
+  }
+
   if (!baudstr) {
     syslog (LOG_ERR, "no baud rate specified");
-    close(fd);
     return -7;
   }
 
   syslog (LOG_DEBUG, "baud string = %s",baudstr);
 
-  int baud=atoi(baudstr);
+  baud=atoi(baudstr);
   speed_t rate;
 
   switch (baud) {
@@ -625,14 +1845,12 @@ int validate_terminal (char* ttystr,char* baudstr)
   case 4000000: rate = B4000000; break;
   default:
     syslog (LOG_ERR, "invalid baud rate %s",baudstr);
-    close(fd);
     return -8;
   }
 
   if((cfsetispeed(&tp,rate) == -1) || 
      (cfsetospeed(&tp,rate) == -1)) {
     syslog (LOG_ERR, "failed to set tty speed to %d", baud);
-    close(fd);
     return -9;
   }
 
@@ -643,19 +1861,42 @@ int validate_terminal (char* ttystr,char* baudstr)
     tp.c_cflag |= CRTSCTS; // enable hardware flow control
   tp.c_cflag &= ~(CSTOPB | PARENB | CSIZE); // clear 2-stop-bits, parity, and character size mask
   tp.c_cflag |= CS8; // set 8-bit characters
-  tp.c_cc[VMIN] = 1;
-  tp.c_cc[VTIME] = 0;
+  if (tty_profile == TTY_THROUGHPUT) {
+    // the driver holds off waking select until a batch has arrived
+    tp.c_cc[VMIN] = tty_vmin;
+    tp.c_cc[VTIME] = 0;
+  } else {
+    tp.c_cc[VMIN] = 1;
+    tp.c_cc[VTIME] = 0;
+  }
 
-  if (tcsetattr(fd, TCSAFLUSH, &tp) == -1) {
+  if (tcsetattr(fd, when, &tp) == -1) {
     syslog (LOG_ERR, "failed to set raw mode");
     return -10;
   }
 
-  return fd;
+  if (tty_profile == TTY_LATENCY && !serial_saved) {
+    // ask the driver to push received bytes up immediately; not all
+    // drivers support it, in which case carry on without
+    struct serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) == -1) {
+      syslog (LOG_INFO, "%m: low latency mode not supported by %s",ttystr);
+    } else {
+      serial_save = ss;
+      serial_saved = 1;
+      ss.flags |= ASYNC_LOW_LATENCY;
+      if (ioctl(fd, TIOCSSERIAL, &ss) == -1)
+	syslog (LOG_INFO, "%m: setting low latency mode on %s failed",ttystr);
+    }
+  }
+
+  return 0;
 }
 
 int restore_tty(int fd)
 {
+  if (serial_saved)
+    ioctl(fd, TIOCSSERIAL, &serial_save);
   tcsetattr(fd, TCSAFLUSH, &save);
   close(fd);
   return 0;
@@ -675,7 +1916,7 @@ int validate_port (char* portstr)
     return -2;
   }
 
-  int optval;
+  int optval = 1;
   struct addrinfo hints, *result, *rp;
 
   memset(&hints, 0, sizeof(struct addrinfo));
@@ -694,7 +1935,7 @@ int validate_port (char* portstr)
   int fd = -1;
 
   for (rp = result ; rp != NULL ; rp = rp->ai_next) {
-    fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
     if (fd == -1)
       continue;
 
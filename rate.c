@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rate.h"
+
+// <bytes/s>[:<records/s>], either may be 0
+int parse_rate (struct rate *r, const char *spec)
+{
+  char *end;
+
+  errno = 0;
+  r->bytes = strtol (spec, &end, 0);
+  r->records = 0;
+  if (*end == ':')
+    r->records = strtol (end + 1, &end, 0);
+  if (errno || *end || r->bytes < 0 || r->records < 0)
+    return -1;
+  return 0;
+}
+
+void bucket_init (struct bucket *b, const struct rate *r, long long now)
+{
+  b->bytes = r->bytes * 1000LL;
+  b->records = r->records * 1000LL;
+  b->stamp = now;
+}
+
+static void refill (struct bucket *b, const struct rate *r, long long now)
+{
+  long long ms = now - b->stamp;
+  if (ms <= 0)
+    return;
+  b->stamp = now;
+  b->bytes += r->bytes * ms;
+  if (b->bytes > r->bytes * 1000LL)
+    b->bytes = r->bytes * 1000LL;
+  b->records += r->records * ms;
+  if (b->records > r->records * 1000LL)
+    b->records = r->records * 1000LL;
+}
+
+void bucket_take (struct bucket *b, const struct rate *r, long long now, int bytes, int records)
+{
+  refill (b, r, now);
+  if (r->bytes)
+    b->bytes -= bytes * 1000LL;
+  if (r->records)
+    b->records -= records * 1000LL;
+}
+
+// ms until the bucket is out of debt, 0 if it isn't in any
+long bucket_wait (struct bucket *b, const struct rate *r, long long now)
+{
+  long wait = bucket_records_wait (b, r, now);
+
+  if (b->bytes < 0) {
+    long w = (-b->bytes + r->bytes - 1) / r->bytes;
+    if (w > wait)
+      wait = w;
+  }
+  return wait;
+}
+
+// the same for records alone
+long bucket_records_wait (struct bucket *b, const struct rate *r, long long now)
+{
+  refill (b, r, now);
+  if (b->records < 0)
+    return (-b->records + r->records - 1) / r->records;
+  return 0;
+}
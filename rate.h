@@ -0,0 +1,20 @@
+// a limit in bytes and records per second, 0 for none
+struct rate {
+  long bytes;
+  long records;
+};
+
+// tokens are kept in thousandths, so refilling every ms loses nothing.
+// a bucket holds at most one second's worth and can go into debt, which
+// has to be paid off before more is read.
+struct bucket {
+  long long bytes;
+  long long records;
+  long long stamp;           // ms of the last refill
+};
+
+int parse_rate (struct rate *r, const char *spec);
+void bucket_init (struct bucket *b, const struct rate *r, long long now);
+void bucket_take (struct bucket *b, const struct rate *r, long long now, int bytes, int records);
+long bucket_wait (struct bucket *b, const struct rate *r, long long now);
+long bucket_records_wait (struct bucket *b, const struct rate *r, long long now);
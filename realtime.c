@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sched.h>
+#include <malloc.h>
+
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+#define STACK_PREFAULT  (256 * 1024)
+
+// [<cpu>][:<prio>]
+int parse_realtime (struct realtime *rt, const char *spec)
+{
+  char *end;
+
+  rt->cpu = -1;
+  rt->prio = REALTIME_PRIO;
+  if (!spec)
+    return 0;
+  if (*spec && *spec != ':') {
+    rt->cpu = strtol (spec, &end, 0);
+    if (end == spec || rt->cpu < 0 || rt->cpu >= CPU_SETSIZE)
+      return -1;
+    spec = end;
+  }
+  if (*spec == ':') {
+    rt->prio = strtol (spec + 1, &end, 0);
+    if (end == spec + 1 || rt->prio < sched_get_priority_min (SCHED_FIFO) ||
+	rt->prio > sched_get_priority_max (SCHED_FIFO))
+      return -1;
+    spec = end;
+  }
+  return *spec ? -1 : 0;
+}
+
+static void prefault_stack (void)
+{
+  volatile char stack[STACK_PREFAULT];
+  memset ((char *) stack, 0, sizeof(stack));
+}
+
+// everything the loop needs has been allocated by now.  lock it in and
+// keep the heap from handing memory back, so nothing faults later, then
+// move to the chosen cpu and a real-time scheduling class.
+int realtime_enter (const struct realtime *rt)
+{
+  mallopt (M_TRIM_THRESHOLD, -1);
+  mallopt (M_MMAP_MAX, 0);
+
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1) {
+    syslog (LOG_ERR, "%m: locking memory failed");
+    return -1;
+  }
+  prefault_stack ();
+
+  if (rt->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (rt->cpu, &set);
+    if (sched_setaffinity (0, sizeof(set), &set) == -1) {
+      syslog (LOG_ERR, "%m: pinning to cpu %d failed", rt->cpu);
+      return -1;
+    }
+  }
+
+  struct sched_param sp;
+  memset (&sp, 0, sizeof(sp));
+  sp.sched_priority = rt->prio;
+  if (sched_setscheduler (0, SCHED_FIFO, &sp) == -1) {
+    syslog (LOG_ERR, "%m: SCHED_FIFO priority %d failed", rt->prio);
+    return -1;
+  }
+
+  syslog (LOG_INFO, "real-time: cpu %d, SCHED_FIFO priority %d, memory locked",
+	  rt->cpu, rt->prio);
+  return 0;
+}
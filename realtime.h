@@ -0,0 +1,10 @@
+#define REALTIME_PRIO   10
+
+// cpu to pin to, -1 to leave affinity alone, and SCHED_FIFO priority
+struct realtime {
+  int cpu;
+  int prio;
+};
+
+int parse_realtime (struct realtime *rt, const char *spec);
+int realtime_enter (const struct realtime *rt);
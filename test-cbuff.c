@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#include "cbuff.h"
+#include "cbuff-model.h"
+
+// unit checks for the cases that have gone wrong before, then long
+// random sequences of every operation against the model
+
+#define RUNS      2000
+#define STEPS     500
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) \
+  do { if (!(cond)) { fprintf (stderr, "%s:%d: ", __FILE__, __LINE__); \
+	 fprintf (stderr, __VA_ARGS__); fputc ('\n', stderr); failures++; } } while (0)
+
+// a full ring starting at 0 has start == end == 0, which must not be
+// taken for an empty or wrapped one
+static void test_full_at_zero (void)
+{
+  struct cbuff cb;
+  char out[16];
+  int p[2];
+
+  new_cbuff (&cb, 8);
+  EXPECT (buf2cbuf (&cb, "abcdefgh", 8) == 8, "fill");
+  EXPECT (cb.start == 0 && cb.end == 0 && cb.left == 0, "full ring at 0");
+  EXPECT (pipe (p) == 0, "pipe");
+  EXPECT (cbuf2write (&cb, p[1], 8) == 8, "write all of a full ring");
+  EXPECT (read (p[0], out, 16) == 8 && !memcmp (out, "abcdefgh", 8), "bytes of a full ring");
+  EXPECT (cb.left == 8, "empty after write");
+  close (p[0]);
+  close (p[1]);
+  free_cbuff (&cb);
+}
+
+// full ring with start and end in the middle
+static void test_full_wrapped (void)
+{
+  struct cbuff cb;
+  struct iovec iov[2];
+  char out[16];
+  int p[2];
+
+  new_cbuff (&cb, 8);
+  buf2cbuf (&cb, "xxxxx", 5);
+  cbuf_discard (&cb, 5);
+  EXPECT (buf2cbuf (&cb, "abcdefgh", 8) == 8, "fill wrapped");
+  EXPECT (cb.start == 5 && cb.end == 5 && cb.left == 0, "full ring at 5");
+  EXPECT (cbuf_iov (&cb, 8, iov) == 2 && iov[0].iov_len == 3 && iov[1].iov_len == 5, "iov of wrapped ring");
+  EXPECT (pipe2 (p, O_NONBLOCK) == 0, "pipe");
+  EXPECT (read2cbuf (&cb, p[0]) == -1, "read into a full ring");
+  EXPECT (cbuf2write (&cb, p[1], 8) == 8, "write wrapped ring");
+  EXPECT (read (p[0], out, 16) == 8 && !memcmp (out, "abcdefgh", 8), "bytes of wrapped ring");
+  close (p[0]);
+  close (p[1]);
+  free_cbuff (&cb);
+}
+
+// resizing keeps the content in order and leaves the indices in range,
+// including when the new size is exactly the content
+static void test_resize (void)
+{
+  struct cbuff cb;
+  char out[16];
+
+  new_cbuff (&cb, 8);
+  buf2cbuf (&cb, "xxxxxx", 6);
+  cbuf_discard (&cb, 6);
+  buf2cbuf (&cb, "abcde", 5);
+  EXPECT (resize_cbuff (&cb, 4) == -1, "shrink below content");
+  EXPECT (resize_cbuff (&cb, 5) == 0, "shrink to content");
+  EXPECT (cb.left == 0 && cb.start == 0 && cb.end == 0, "resized full ring, end %d", cb.end);
+  EXPECT (resize_cbuff (&cb, 16) == 0 && cb.end == 5, "grow");
+  EXPECT (model_take (&cb, (unsigned char *) out, 16) == 5 && !memcmp (out, "abcde", 5),
+	  "content after resize");
+  free_cbuff (&cb);
+}
+
+static void test_dump (void)
+{
+  struct cbuff cb;
+  int save = dup (STDERR_FILENO);
+  int null = open ("/dev/null", O_WRONLY);
+
+  new_cbuff (&cb, 8);
+  buf2cbuf (&cb, "abc", 3);
+  dup2 (null, STDERR_FILENO);
+  int n = dump_cbuf (&cb);
+  dup2 (save, STDERR_FILENO);
+  EXPECT (n == 3, "dump_cbuf returned %d", n);
+  close (null);
+  close (save);
+  free_cbuff (&cb);
+}
+
+static void test_sizing (void)
+{
+  struct cbuff_sizing sz;
+  struct cbuff_policy p = { 64, 64, 4096 };
+  struct cbuff cb;
+
+  memset (&sz, 0, sizeof(sz));
+  EXPECT (cbuf_suggest (&sz, 90) == 0, "no records seen");
+  for (int i=0 ; i<95 ; i++)
+    cbuf_note_record (&sz, 100);
+  for (int i=0 ; i<5 ; i++)
+    cbuf_note_record (&sz, 3000);
+  EXPECT (cbuf_suggest (&sz, 90) == 128, "90th percentile %d", cbuf_suggest (&sz, 90));
+  EXPECT (cbuf_suggest (&sz, 99) == 4096, "99th percentile %d", cbuf_suggest (&sz, 99));
+
+  new_cbuff (&cb, 64);
+  EXPECT (cbuf_grow_size (&cb, &p, &sz) == 128, "grow to the usual size");
+  resize_cbuff (&cb, 4096);
+  EXPECT (cbuf_grow_size (&cb, &p, &sz) == -1, "grow past max");
+  buf2cbuf (&cb, "abc", 3);
+  EXPECT (cbuf_shrink (&cb, &p) == 0 && cb.len == 64, "shrink to min, len %d", cb.len);
+  free_cbuff (&cb);
+}
+
+int main (int argc, char **argv)
+{
+  unsigned char ops[1 + 2 * STEPS];
+
+  setlogmask (LOG_UPTO (LOG_CRIT));
+
+  test_full_at_zero ();
+  test_full_wrapped ();
+  test_resize ();
+  test_dump ();
+  test_sizing ();
+
+  srandom (argc > 1 ? atoi (argv[1]) : 1);
+  for (int run=0 ; run<RUNS && !failures ; run++) {
+    for (int i=0 ; i<(int) sizeof(ops) ; i++)
+      ops[i] = random ();
+    if (model_run (ops, sizeof(ops)) < 0) {
+      fprintf (stderr, "random run %d failed\n", run);
+      failures++;
+    }
+  }
+
+  printf ("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#include "cbuff.h"
+#include "framing.h"
+
+// each framer fed random streams of records in reads of random size,
+// through a ring small enough that records and headers wrap, with
+// records sometimes taken in two parts.  then the cases that have to
+// come out exactly: a header split by the wrap, leading flags, a record
+// passed on in pieces and lengths past FRAME_MAXLEN.
+
+#define RUNS      200
+#define RECORDS   200
+#define RING      512
+#define MAXREC    200           // payload bytes, so two records fit
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) \
+  do { if (!(cond)) { fprintf (stderr, "%s:%d: ", __FILE__, __LINE__); \
+	 fprintf (stderr, __VA_ARGS__); fputc ('\n', stderr); failures++; } } while (0)
+
+// append one record in fr's framing to s, returns its size
+static int encode (const struct framing *fr, unsigned char *s)
+{
+  int len = random () % (MAXREC + 1), n = 0;
+
+  switch (fr->kind) {
+  case FRAME_LENGTH:
+    if (fr->lenwidth == 1 && len > 255)
+      len = 255;
+    for (int i=fr->lenwidth - 1 ; i>=0 ; i--)
+      s[n++] = len >> (8 * i);
+    for (int i=0 ; i<len ; i++)
+      s[n++] = random ();
+    return n;
+  case FRAME_DELIM:
+    for (int i=0 ; i<len ; i++)
+      s[n++] = 'a' + random () % 26;
+    s[n++] = fr->flag;
+    return n;
+  default:
+    // some senders open a frame with a flag, which stays with it
+    for (int i=random () % 3 ; i>0 ; i--)
+      s[n++] = fr->flag;
+    if (!len)
+      len = 1;
+    for (int i=0 ; i<len ; i++) {
+      s[n] = random ();
+      if (s[n] == fr->flag)
+	s[n]++;
+      n++;
+    }
+    s[n++] = fr->flag;
+    return n;
+  }
+}
+
+// the first n bytes of cb are p
+static int same (struct cbuff *cb, const unsigned char *p, int n)
+{
+  struct iovec iov[2];
+  int iovcnt = cbuf_iov (cb, n, iov);
+  if (memcmp (iov[0].iov_base, p, iov[0].iov_len))
+    return 0;
+  return iovcnt < 2 || !memcmp (iov[1].iov_base, p + iov[0].iov_len, iov[1].iov_len);
+}
+
+static void test_stream (const char *spec)
+{
+  static unsigned char s[RECORDS * (MAXREC + 8)];
+  int size[RECORDS];
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+
+  EXPECT (parse_framing (&fr, spec) == 0, "parse %s", spec);
+  for (int run=0 ; run<RUNS && !failures ; run++) {
+    int len = 0, off = 0, rec = 0, at = 0;
+    for (int i=0 ; i<RECORDS ; i++)
+      len += size[i] = encode (&fr, s + len);
+
+    new_cbuff (&cb, RING);
+    framer_init (&f, &fr);
+    while (rec < RECORDS && !failures) {
+      int n = 1 + random () % cb.len;
+      if (n > cb.left)
+	n = cb.left;
+      if (n > len - off)
+	n = len - off;
+      off += buf2cbuf (&cb, (char *) s + off, n);
+
+      int r;
+      while ((r = framer_next (&f, &cb)) > 0 && !failures) {
+	EXPECT (r == size[rec], "%s run %d: record %d is %d bytes, expected %d",
+		spec, run, rec, r, size[rec]);
+	EXPECT (same (&cb, s + at, r), "%s run %d: record %d content", spec, run, rec);
+	// a record may be written out in more than one go
+	int part = random () % 2 ? random () % r : 0;
+	if (part) {
+	  cbuf_discard (&cb, part);
+	  framer_consume (&f, part);
+	  EXPECT (framer_next (&f, &cb) == r - part, "%s run %d: rest of record %d", spec, run, rec);
+	}
+	cbuf_discard (&cb, r - part);
+	framer_consume (&f, r - part);
+	at += r;
+	rec++;
+      }
+      EXPECT (r == 0, "%s run %d: framing error at record %d", spec, run, rec);
+      EXPECT (cb.left || off == len, "%s run %d: full ring without a record", spec, run);
+      if (!cb.left)
+	break;
+    }
+    EXPECT (rec == RECORDS && cb.left == cb.len, "%s run %d: %d of %d records, %d bytes left",
+	    spec, run, rec, RECORDS, cb.len - cb.left);
+    free_cbuff (&cb);
+  }
+}
+
+// a 4 byte header with two bytes before the wrap and two after
+static void test_split_header (void)
+{
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+
+  parse_framing (&fr, "length:4");
+  new_cbuff (&cb, 8);
+  buf2cbuf (&cb, "xxxxxx", 6);
+  cbuf_discard (&cb, 6);
+  framer_init (&f, &fr);
+  buf2cbuf (&cb, "\0\0", 2);
+  EXPECT (framer_next (&f, &cb) == 0, "half a header");
+  buf2cbuf (&cb, "\0\3ab", 4);
+  EXPECT (framer_next (&f, &cb) == 0, "header and part of the payload");
+  buf2cbuf (&cb, "c", 1);
+  EXPECT (framer_next (&f, &cb) == 7, "header split by the wrap, record %d", framer_next (&f, &cb));
+  free_cbuff (&cb);
+}
+
+// leading flags are kept with the record after them, and flags alone
+// aren't a record
+static void test_leading_flags (void)
+{
+  static const char *specs[] = { "slip", "hdlc", "cobs" };
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+  char s[8];
+
+  for (int i=0 ; i<3 ; i++) {
+    parse_framing (&fr, specs[i]);
+    new_cbuff (&cb, 16);
+    framer_init (&f, &fr);
+    memset (s, fr.flag, 3);
+    buf2cbuf (&cb, s, 3);
+    EXPECT (framer_next (&f, &cb) == 0, "%s: flags alone", specs[i]);
+    memcpy (s, "ab", 2);
+    s[2] = fr.flag;
+    buf2cbuf (&cb, s, 3);
+    EXPECT (framer_next (&f, &cb) == 6, "%s: record with leading flags is %d bytes",
+	    specs[i], framer_next (&f, &cb));
+    free_cbuff (&cb);
+  }
+}
+
+// a record too big for its ring is passed on in pieces, and the record
+// after it is still framed from its own header
+static void test_pieces (void)
+{
+  static const char *specs[] = { "length:4", "delim", "hdlc" };
+  unsigned char s[2 * (MAXREC + 8)];
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+
+  for (int i=0 ; i<3 ; i++) {
+    parse_framing (&fr, specs[i]);
+    srandom (i);
+    int big = encode (&fr, s);
+    while (big <= 16)
+      big = encode (&fr, s);
+    int next = encode (&fr, s + big);
+    while (next > 12)
+      next = encode (&fr, s + big);
+    new_cbuff (&cb, 16);
+    framer_init (&f, &fr);
+    int off = 0, r = 0;
+    while (off < big + next && !failures) {
+      off += buf2cbuf (&cb, (char *) s + off, big + next - off);
+      r = framer_next (&f, &cb);
+      if (r)
+	break;
+      EXPECT (!cb.left, "%s: no record in a ring with room", specs[i]);
+      cbuf_discard (&cb, cb.len);
+      framer_skip (&f, cb.len);
+    }
+    EXPECT (r == big - (big / 16) * 16 || (r == 16 && big % 16 == 0),
+	    "%s: last piece of %d bytes is %d", specs[i], big, r);
+    cbuf_discard (&cb, r);
+    framer_consume (&f, r);
+    off += buf2cbuf (&cb, (char *) s + off, big + next - off);
+    EXPECT (framer_next (&f, &cb) == next, "%s: record after the pieces is %d bytes, expected %d",
+	    specs[i], framer_next (&f, &cb), next);
+    free_cbuff (&cb);
+  }
+}
+
+// a length of FRAME_MAXLEN is waited for, one more is an error
+static void test_maxlen (void)
+{
+  struct framing fr;
+  struct framer f;
+  struct cbuff cb;
+  unsigned char h[4];
+
+  parse_framing (&fr, "length:4");
+  new_cbuff (&cb, 16);
+  for (unsigned long len=FRAME_MAXLEN ; len<=FRAME_MAXLEN + 1 ; len++) {
+    for (int i=0 ; i<4 ; i++)
+      h[i] = len >> (8 * (3 - i));
+    framer_init (&f, &fr);
+    buf2cbuf (&cb, (char *) h, 4);
+    EXPECT (framer_next (&f, &cb) == (len > FRAME_MAXLEN ? -1 : 0), "length %lu", len);
+    cbuf_discard (&cb, 4);
+  }
+  free_cbuff (&cb);
+}
+
+int main (int argc, char **argv)
+{
+  setlogmask (LOG_UPTO (LOG_CRIT));
+
+  test_split_header ();
+  test_leading_flags ();
+  test_pieces ();
+  test_maxlen ();
+
+  srandom (argc > 1 ? atoi (argv[1]) : 1);
+  test_stream ("delim");
+  test_stream ("length:1");
+  test_stream ("length:2");
+  test_stream ("length:4");
+  test_stream ("slip");
+  test_stream ("cobs");
+  test_stream ("hdlc");
+
+  printf ("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
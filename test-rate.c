@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rate.h"
+
+// the rate limits' token buckets, at ms resolution: parsing, debt and
+// paying it off, refills capped at one second's worth, waits rounded
+// up, limits on bytes or records alone and a clock that steps back.
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) \
+  do { if (!(cond)) { fprintf (stderr, "%s:%d: ", __FILE__, __LINE__); \
+	 fprintf (stderr, __VA_ARGS__); fputc ('\n', stderr); failures++; } } while (0)
+
+static void test_parse (void)
+{
+  struct rate r;
+
+  EXPECT (parse_rate (&r, "1000") == 0 && r.bytes == 1000 && r.records == 0, "1000");
+  EXPECT (parse_rate (&r, "1000:50") == 0 && r.bytes == 1000 && r.records == 50, "1000:50");
+  EXPECT (parse_rate (&r, "0:10") == 0 && r.bytes == 0 && r.records == 10, "0:10");
+  EXPECT (parse_rate (&r, "0x400") == 0 && r.bytes == 1024, "0x400");
+  EXPECT (parse_rate (&r, "-5") < 0, "-5 accepted");
+  EXPECT (parse_rate (&r, "5:-1") < 0, "5:-1 accepted");
+  EXPECT (parse_rate (&r, "5k") < 0, "5k accepted");
+  EXPECT (parse_rate (&r, "5:6:7") < 0, "5:6:7 accepted");
+  EXPECT (parse_rate (&r, "99999999999999999999") < 0, "overflow accepted");
+}
+
+// a full bucket goes into debt and is paid off at the rate
+static void test_debt (void)
+{
+  struct rate r = { 1000, 0 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &r, 5000);
+  EXPECT (bucket_wait (&b, &r, 5000) == 0, "full bucket waits");
+  bucket_take (&b, &r, 5000, 1000, 1);
+  EXPECT ((w = bucket_wait (&b, &r, 5000)) == 0, "emptied bucket waits %ld", w);
+  bucket_take (&b, &r, 5000, 500, 1);
+  EXPECT ((w = bucket_wait (&b, &r, 5000)) == 500, "500 bytes over waits %ld, expected 500", w);
+  EXPECT ((w = bucket_wait (&b, &r, 5250)) == 250, "after 250ms waits %ld, expected 250", w);
+  EXPECT ((w = bucket_wait (&b, &r, 5499)) == 1, "after 499ms waits %ld, expected 1", w);
+  EXPECT ((w = bucket_wait (&b, &r, 5500)) == 0, "paid off waits %ld", w);
+}
+
+// no more than one second's worth builds up, however long it's idle
+static void test_cap (void)
+{
+  struct rate r = { 1000, 10 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &r, 0);
+  bucket_take (&b, &r, 100000, 0, 0);
+  EXPECT (b.bytes == 1000 * 1000LL && b.records == 10 * 1000LL,
+	  "idle bucket holds %lld bytes, %lld records (thousandths)", b.bytes, b.records);
+  bucket_take (&b, &r, 100000, 2000, 0);
+  EXPECT ((w = bucket_wait (&b, &r, 100000)) == 1000, "a second over waits %ld", w);
+}
+
+// waits are rounded up, so that the bucket is out of debt after them
+static void test_round (void)
+{
+  struct rate r = { 3, 7 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &r, 0);
+  bucket_take (&b, &r, 0, 4, 0);
+  EXPECT ((w = bucket_wait (&b, &r, 0)) == 334, "1 byte at 3/s waits %ld, expected 334", w);
+  EXPECT ((w = bucket_wait (&b, &r, 333)) == 1, "after 333ms waits %ld, expected 1", w);
+  EXPECT ((w = bucket_wait (&b, &r, 334)) == 0, "after 334ms waits %ld", w);
+
+  bucket_init (&b, &r, 0);
+  bucket_take (&b, &r, 0, 0, 8);
+  EXPECT ((w = bucket_records_wait (&b, &r, 0)) == 143, "1 record at 7/s waits %ld, expected 143", w);
+  EXPECT ((w = bucket_wait (&b, &r, 0)) == 143, "bucket_wait for records %ld, expected 143", w);
+  EXPECT ((w = bucket_records_wait (&b, &r, 143)) == 0, "after 143ms waits %ld", w);
+}
+
+// bucket_wait is the longer of the two, bucket_records_wait only
+// looks at records
+static void test_both (void)
+{
+  struct rate r = { 100, 10 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &r, 0);
+  bucket_take (&b, &r, 0, 300, 12);
+  EXPECT ((w = bucket_wait (&b, &r, 0)) == 2000, "bytes 2s behind waits %ld", w);
+  EXPECT ((w = bucket_records_wait (&b, &r, 0)) == 200, "records 200ms behind waits %ld", w);
+
+  bucket_init (&b, &r, 0);
+  bucket_take (&b, &r, 0, 110, 30);
+  EXPECT ((w = bucket_wait (&b, &r, 0)) == 2000, "records 2s behind waits %ld", w);
+}
+
+// a limit of 0 is no limit, whatever is taken
+static void test_alone (void)
+{
+  struct rate bytes = { 100, 0 }, records = { 0, 10 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &bytes, 0);
+  bucket_take (&b, &bytes, 0, 200, 1000);
+  EXPECT ((w = bucket_records_wait (&b, &bytes, 0)) == 0, "no record limit waits %ld", w);
+  EXPECT ((w = bucket_wait (&b, &bytes, 0)) == 1000, "bytes alone waits %ld", w);
+
+  bucket_init (&b, &records, 0);
+  bucket_take (&b, &records, 0, 1 << 30, 20);
+  EXPECT ((w = bucket_wait (&b, &records, 0)) == 1000, "records alone waits %ld", w);
+  EXPECT (b.bytes == 0, "no byte limit, bytes in the bucket %lld", b.bytes);
+}
+
+// a clock that goes back refills nothing and doesn't lose the time
+// already counted
+static void test_backwards (void)
+{
+  struct rate r = { 1000, 0 };
+  struct bucket b;
+  long w;
+
+  bucket_init (&b, &r, 1000);
+  bucket_take (&b, &r, 1000, 1500, 0);
+  EXPECT ((w = bucket_wait (&b, &r, 900)) == 500, "clock back waits %ld, expected 500", w);
+  EXPECT ((w = bucket_wait (&b, &r, 1400)) == 100, "then forward waits %ld, expected 100", w);
+}
+
+int main (void)
+{
+  test_parse ();
+  test_debt ();
+  test_cap ();
+  test_round ();
+  test_both ();
+  test_alone ();
+  test_backwards ();
+
+  printf ("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "timer.h"
+
+// the wheel against a brute-force model: an array of timers and the
+// tick each is due on.  random adds, cancels and runs, with deadlines
+// on every level, past the end of the wheel and already gone, and
+// callbacks that re-arm themselves or arm and cancel others.  every
+// timer has to fire on the tick it is due and no other, and
+// timer_next() must never sleep past the first one.
+
+#define TIMERS    64
+#define RUNS      25
+#define STEPS     1000
+
+#define WHEEL_SPAN  (1LL << (TIMER_LEVELS * TIMER_SLOTBITS))
+
+static int failures = 0;
+
+#define EXPECT(cond, ...) \
+  do { if (!(cond)) { fprintf (stderr, "%s:%d: ", __FILE__, __LINE__); \
+	 fprintf (stderr, __VA_ARGS__); fputc ('\n', stderr); failures++; } } while (0)
+
+static struct timer_wheel w;
+static struct timer t[TIMERS];
+static int armed[TIMERS];
+static long long due[TIMERS];     // tick it has to fire on
+static int fired;
+
+// a deadline relative to the clock, weighted towards the lower levels
+static long long deadline (void)
+{
+  switch (random () % 8) {
+  case 0:
+    return w.clk - random () % 100;
+  case 1:
+  case 2:
+    return w.clk + random () % TIMER_SLOTS;
+  case 3:
+  case 4:
+    return w.clk + random () % (TIMER_SLOTS * TIMER_SLOTS);
+  case 5:
+    return w.clk + random () % (TIMER_SLOTS * TIMER_SLOTS * TIMER_SLOTS);
+  default:
+    // rarely on the top level or past the end of the wheel, running
+    // the clock to them takes a while
+    switch (random () % 32) {
+    case 0:
+      return w.clk + random () % WHEEL_SPAN;
+    case 1:
+      return w.clk + WHEEL_SPAN + random () % 100000;
+    }
+    return w.clk + random () % (TIMER_SLOTS * TIMER_SLOTS);
+  }
+}
+
+static void arm (int i, long long expires)
+{
+  timer_add (&w, &t[i], expires);
+  armed[i] = 1;
+  due[i] = expires > w.clk ? expires : w.clk;
+}
+
+static void disarm (int i)
+{
+  timer_cancel (&w, &t[i]);
+  armed[i] = 0;
+}
+
+static void expired (struct timer *tm)
+{
+  int i = tm->data;
+
+  EXPECT (armed[i] && due[i] == w.clk, "timer %d fired at %lld, due %lld%s",
+	  i, w.clk, due[i], armed[i] ? "" : " and not armed");
+  EXPECT (!timer_pending (tm), "timer %d still linked in its callback", i);
+  armed[i] = 0;
+  fired++;
+
+  switch (random () % 8) {
+  case 0:
+    arm (i, w.clk + random () % 200);
+    break;
+  case 1:
+    // due now, which has to run on this same tick
+    arm (random () % TIMERS, w.clk - random () % 2);
+    break;
+  case 2:
+    disarm (random () % TIMERS);
+    break;
+  }
+}
+
+static void check (void)
+{
+  int count = 0;
+  long long first = -1;
+
+  for (int i=0 ; i<TIMERS ; i++) {
+    EXPECT (armed[i] == timer_pending (&t[i]), "timer %d pending %d, armed %d",
+	    i, timer_pending (&t[i]) ? 1 : 0, armed[i]);
+    if (!armed[i])
+      continue;
+    count++;
+    EXPECT (due[i] >= w.clk, "timer %d due at %lld missed, clock at %lld", i, due[i], w.clk);
+    if (first < 0 || due[i] < first)
+      first = due[i];
+  }
+  EXPECT (w.count == count, "wheel counts %d timers, %d armed", w.count, count);
+
+  long long next = timer_next (&w);
+  if (!count)
+    EXPECT (next == -1, "nothing armed, timer_next %lld", next);
+  else
+    EXPECT (next >= 0 && w.clk + next <= first, "timer_next %lld from %lld, first due %lld",
+	    next, w.clk, first);
+}
+
+// anything still armed and due by now has been missed, which check()
+// catches
+static void run (long long now)
+{
+  fired = 0;
+  int ran = timer_run (&w, now);
+  EXPECT (ran == fired, "timer_run ran %d, %d callbacks", ran, fired);
+  EXPECT (w.clk == now + 1, "clock at %lld after running to %lld", w.clk, now);
+}
+
+int main (int argc, char **argv)
+{
+  setlogmask (LOG_UPTO (LOG_CRIT));
+  srandom (argc > 1 ? atoi (argv[1]) : 1);
+
+  for (int r=0 ; r<RUNS && !failures ; r++) {
+    // start anywhere, so slot indices and cascades aren't aligned
+    timer_wheel_init (&w, random () % WHEEL_SPAN);
+    for (int i=0 ; i<TIMERS ; i++) {
+      timer_init (&t[i], expired, i);
+      armed[i] = 0;
+    }
+    for (int s=0 ; s<STEPS && !failures ; s++) {
+      int i = random () % TIMERS;
+      long long next;
+      switch (random () % 6) {
+      case 0:
+      case 1:
+	arm (i, deadline ());
+	break;
+      case 2:
+	disarm (i);
+	break;
+      case 3:
+	// as the loop does, sleep until timer_next says and run
+	next = timer_next (&w);
+	run (w.clk + (next > 0 ? next : 0));
+	break;
+      case 4:
+	run (w.clk + random () % 100);
+	break;
+      default:
+	run (w.clk + random () % (TIMER_SLOTS * TIMER_SLOTS * 4));
+	break;
+      }
+      check ();
+    }
+  }
+
+  printf ("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(l)  ((l) * TIMER_SLOTBITS)
+#define MAX_DELTA       ((1LL << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+void timer_wheel_init (struct timer_wheel *w, long long now)
+{
+  memset (w, 0, sizeof(*w));
+  w->clk = now;
+}
+
+void timer_init (struct timer *t, void (*fn) (struct timer *t), long data)
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->data = data;
+}
+
+static void link_timer (struct timer_wheel *w, struct timer *t)
+{
+  long long when = t->expires;
+  long long delta = when - w->clk;
+  int level = 0;
+
+  if (delta < 0) {
+    // already due, run on the next tick
+    delta = 0;
+    when = w->clk;
+  } else if (delta > MAX_DELTA) {
+    // beyond the wheel, park it in the furthest slot and it will be
+    // placed again when that is cascaded
+    delta = MAX_DELTA;
+    when = w->clk + MAX_DELTA;
+  }
+  while (level < TIMER_LEVELS - 1 && delta >= (1LL << LEVEL_SHIFT(level + 1)))
+    level++;
+
+  struct timer **head =
+    &w->slots[level][(when >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1)];
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+static void unlink_timer (struct timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+// (re)arm t to fire at expires
+void timer_add (struct timer_wheel *w, struct timer *t, long long expires)
+{
+  if (timer_pending (t))
+    unlink_timer (t);
+  else
+    w->count++;
+  t->expires = expires;
+  link_timer (w, t);
+}
+
+void timer_cancel (struct timer_wheel *w, struct timer *t)
+{
+  if (!timer_pending (t))
+    return;
+  unlink_timer (t);
+  w->count--;
+}
+
+// move the timers of one higher level slot down to where they now belong
+static int cascade (struct timer_wheel *w, int level)
+{
+  int index = (w->clk >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1);
+  struct timer *t = w->slots[level][index];
+  w->slots[level][index] = NULL;
+  while (t) {
+    struct timer *next = t->next;
+    link_timer (w, t);
+    t = next;
+  }
+  return index;
+}
+
+// run every timer due at or before now, returns how many ran.  a
+// callback may add or cancel any timer, including itself.
+int timer_run (struct timer_wheel *w, long long now)
+{
+  int ran = 0;
+
+  while (w->clk <= now) {
+    if (!w->count) {
+      w->clk = now + 1;
+      break;
+    }
+
+    int index = w->clk & (TIMER_SLOTS - 1);
+    if (!index)
+      for (int level=1 ; level<TIMER_LEVELS && !cascade (w, level) ; level++)
+	;
+
+    struct timer **head = &w->slots[0][index];
+    while (*head) {
+      struct timer *t = *head;
+      unlink_timer (t);
+      w->count--;
+      t->fn (t);
+      ran++;
+    }
+    w->clk++;
+  }
+  return ran;
+}
+
+// ticks from the wheel's clock until timer_run() has something to do,
+// either a timer to fire or a slot to cascade, or -1 if nothing is
+// pending.  looks at slots, never at individual timers.
+long long timer_next (struct timer_wheel *w)
+{
+  if (!w->count)
+    return -1;
+
+  long long next = -1;
+  for (int i=0 ; i<TIMER_SLOTS ; i++)
+    if (w->slots[0][(w->clk + i) & (TIMER_SLOTS - 1)]) {
+      next = i;
+      break;
+    }
+
+  // a higher level slot may come due, and need cascading, sooner
+  for (int level=1 ; level<TIMER_LEVELS ; level++) {
+    long long base = w->clk >> LEVEL_SHIFT(level);
+    // the current slot is only cascaded once the clock has run past
+    // its first tick
+    int first = (w->clk & ((1LL << LEVEL_SHIFT(level)) - 1)) ? 1 : 0;
+    for (int i=first ; i<=TIMER_SLOTS ; i++) {
+      if (w->slots[level][(base + i) & (TIMER_SLOTS - 1)]) {
+	long long when = ((base + i) << LEVEL_SHIFT(level)) - w->clk;
+	if (next < 0 || when < next)
+	  next = when;
+	break;
+      }
+    }
+  }
+  return next;
+}
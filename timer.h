@@ -0,0 +1,32 @@
+#define TIMER_LEVELS     4
+#define TIMER_SLOTBITS   6
+#define TIMER_SLOTS      (1 << TIMER_SLOTBITS)
+
+// timers are embedded in the structures they belong to and linked
+// into the wheel, so adding and cancelling never allocate.  times are
+// in ms ticks.
+struct timer {
+  struct timer *next;
+  struct timer **pprev;      // NULL when not pending
+  long long expires;
+  void (*fn) (struct timer *t);
+  long data;
+};
+
+// level 0 holds the next TIMER_SLOTS ticks one per slot, each level
+// above covers TIMER_SLOTS times the span of the one below and is
+// cascaded down as the clock reaches it
+struct timer_wheel {
+  long long clk;             // next tick to be run
+  int count;
+  struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init (struct timer_wheel *w, long long now);
+void timer_init (struct timer *t, void (*fn) (struct timer *t), long data);
+void timer_add (struct timer_wheel *w, struct timer *t, long long expires);
+void timer_cancel (struct timer_wheel *w, struct timer *t);
+int timer_run (struct timer_wheel *w, long long now);
+long long timer_next (struct timer_wheel *w);
+
+#define timer_pending(t) ((t)->pprev != NULL)
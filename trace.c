@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_ALTSTACK  65536
+
+struct trace_ring trace_ring;
+
+static char trace_path[256];
+static struct trace_header trace_hdr;
+
+static const char *names[TR_MAX] = {
+  [TR_WAKE]      = "wake",
+  [TR_READ]      = "read",
+  [TR_RECORD]    = "record",
+  [TR_TTY_WRITE] = "tty-write",
+  [TR_WRITE]     = "write",
+  [TR_PARTIAL]   = "partial",
+  [TR_RESIZE]    = "resize",
+  [TR_FULL]      = "full",
+  [TR_ACCEPT]    = "accept",
+  [TR_REJECT]    = "reject",
+  [TR_CLOSE]     = "close",
+  [TR_RELEASE]   = "release",
+  [TR_PACE]      = "pace",
+  [TR_TIMER]     = "timer",
+  [TR_BROADCAST] = "broadcast",
+  [TR_THROTTLE]  = "throttle",
+};
+
+const char *trace_name (int type)
+{
+  if (type <= 0 || type >= TR_MAX || !names[type])
+    return "unknown";
+  return names[type];
+}
+
+unsigned long long trace_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// write the ring to the trace file.  only async-signal-safe calls, so
+// it can be run from a handler, including one for a crash.
+int trace_dump (void)
+{
+  struct trace_header h = trace_hdr;
+  h.head = trace_ring.head;
+  h.clk1 = trace_clock ();
+  h.ns1 = trace_ns ();
+
+  int fd = open (trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  int ok = write (fd, &h, sizeof(h)) == sizeof(h) &&
+    write (fd, trace_ring.ev, sizeof(trace_ring.ev)) == sizeof(trace_ring.ev);
+  close (fd);
+  return ok ? 0 : -1;
+}
+
+static void dump_handler (int sig)
+{
+  trace_dump ();
+}
+
+// the handler is reset as it runs, so raising the signal again once the
+// ring is out lets the crash carry on as it would have
+static void crash_handler (int sig)
+{
+  trace_dump ();
+  raise (sig);
+}
+
+int trace_init (const char *path)
+{
+  static char altstack[TRACE_ALTSTACK];
+  static const int crashes[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+  struct sigaction sa;
+  stack_t ss;
+
+  snprintf (trace_path, sizeof(trace_path), "%s", path);
+  trace_hdr.magic = TRACE_MAGIC;
+  trace_hdr.version = TRACE_VERSION;
+  trace_hdr.events = TRACE_EVENTS;
+  trace_hdr.size = sizeof(struct trace_event);
+  trace_hdr.clk0 = trace_clock ();
+  trace_hdr.ns0 = trace_ns ();
+
+  memset (&sa, 0, sizeof(sa));
+  sigemptyset (&sa.sa_mask);
+  sa.sa_handler = dump_handler;
+  sa.sa_flags = SA_RESTART;
+  if (sigaction (SIGUSR1, &sa, NULL) == -1) {
+    syslog (LOG_ERR, "%m: can't catch SIGUSR1 for tracing");
+    return -1;
+  }
+
+  // a stack overflow leaves no stack to dump from
+  ss.ss_sp = altstack;
+  ss.ss_size = sizeof(altstack);
+  ss.ss_flags = 0;
+  if (sigaltstack (&ss, NULL) == -1)
+    syslog (LOG_ERR, "%m: no alternate signal stack for tracing");
+
+  sa.sa_handler = crash_handler;
+  sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+  for (int i=0 ; i<(int) (sizeof(crashes) / sizeof(crashes[0])) ; i++)
+    sigaction (crashes[i], &sa, NULL);
+
+  syslog (LOG_DEBUG, "tracing to %s on SIGUSR1", trace_path);
+  return 0;
+}
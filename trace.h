@@ -0,0 +1,78 @@
+#define TRACE_EVENTS   16384          // power of two
+#define TRACE_MAGIC    0x4d325454     // "M2TT"
+#define TRACE_VERSION  1
+
+#define TR_WAKE        1   // select returned, arg = ready fds
+#define TR_READ        2   // arg = bytes read, or -1
+#define TR_RECORD      3   // complete record found, arg = size
+#define TR_TTY_WRITE   4   // arg = bytes written to the tty
+#define TR_WRITE       5   // tty record written to a session, arg = bytes
+#define TR_PARTIAL     6   // short write to a session, arg = bytes written
+#define TR_RESIZE      7   // arg = new buffer size
+#define TR_FULL        8   // buffer full without a complete record
+#define TR_ACCEPT      9   // arg = listener index
+#define TR_REJECT      10
+#define TR_CLOSE       11
+#define TR_RELEASE     12
+#define TR_PACE        13  // tty output queue full, arg = usec to wait
+#define TR_TIMER       14  // arg = which timer fired
+#define TR_BROADCAST   15  // tty record, arg = size
+#define TR_THROTTLE    16  // over its rate, arg = ms until it may be read
+#define TR_MAX         17
+
+#define TR_TIMER_IDLE   0
+#define TR_TIMER_FLUSH  1
+#define TR_TIMER_STALL  2
+
+// events are 16 bytes and written in place with no locking.  mux2tty
+// has one thread, and the only other reader is a signal handler on
+// that same thread, which at worst sees the newest event half written.
+struct trace_event {
+  unsigned long long ts;     // trace_clock() ticks
+  unsigned short type;
+  short fd;
+  int arg;
+};
+
+struct trace_ring {
+  unsigned long long head;   // events ever recorded
+  struct trace_event ev[TRACE_EVENTS];
+};
+
+// a dump is this header followed by the ring as it is in memory.  the
+// two clock pairs let ticks be turned into time.
+struct trace_header {
+  unsigned magic;
+  unsigned version;
+  unsigned events;
+  unsigned size;             // of one event
+  unsigned long long head;
+  unsigned long long clk0, ns0;   // at trace_init
+  unsigned long long clk1, ns1;   // at the dump
+};
+
+extern struct trace_ring trace_ring;
+
+unsigned long long trace_ns (void);
+
+// the tsc where there is one, it is a few times cheaper to read
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define trace_clock()  __rdtsc()
+#else
+#define trace_clock()  trace_ns()
+#endif
+
+static inline void trace (int type, int fd, int arg)
+{
+  struct trace_event *e = &trace_ring.ev[trace_ring.head & (TRACE_EVENTS - 1)];
+  e->ts = trace_clock ();
+  e->type = type;
+  e->fd = fd;
+  e->arg = arg;
+  trace_ring.head++;
+}
+
+int trace_init (const char *path);
+int trace_dump (void);
+const char *trace_name (int type);